@@ -2,11 +2,51 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and MAP_NORESERVE
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <string.h> // for memset()
+#include <sys/mman.h> // for mmap()
 
 #include "mem_pool.h"
+#include "mem_trace.h"
+
+/************************/
+/*                      */
+/* Compile-time options */
+/*                      */
+/************************/
+#define MEM_POOL_HISTOGRAM // comment out to compile out the size-class counters
+//#define MEM_POOL_PROFILE // define to count search lengths and time the hot paths
+//#define MEM_POOL_TRACE // define to allow recording allocation traces (see mem_trace.h)
+#define MEM_POOL_SAMPLE // comment out to compile out allocation sampling (see mem_sample_open())
+//#define MEM_POOL_PROBES // define for static probes (see PROBE below), needs sys/sdt.h
+
+#ifdef MEM_POOL_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // for __rdtsc()
+#else
+#include <time.h> // for clock_gettime()
+#endif
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MEM_BITMAP_AVX2 // the bitmap scans take four words at a time where the CPU has AVX2
+#include <immintrin.h> // for the AVX2 intrinsics
+#endif
+
+#include <stdint.h> // for uintptr_t
+
+#ifdef MEM_POOL_SAMPLE
+#include <execinfo.h> // for backtrace()
+#endif
+
+#ifdef MEM_POOL_PROBES
+#include <sys/sdt.h> // for DTRACE_PROBE()
+#endif
+
 
 /*************/
 /*           */
@@ -19,14 +59,45 @@ static const unsigned   MEM_EXPAND_FACTOR               = 2;
 static const unsigned   MEM_POOL_STORE_INIT_CAPACITY    = 20;
 static const float      MEM_POOL_STORE_FILL_FACTOR      = 0.75;
 static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = 2;
+static const unsigned   MEM_POOL_STORE_NO_SLOT          = (unsigned) -1; // end of the free-slot list
 
 static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
 static const float      MEM_NODE_HEAP_FILL_FACTOR       = 0.75;
 static const unsigned   MEM_NODE_HEAP_EXPAND_FACTOR     = 2;
+static const float      MEM_NODE_HEAP_SHRINK_FACTOR     = 0.25; // fill the rest would have if the top block went
+static const size_t     MEM_GAP_LINK_ALIGNMENT          = 64; // a cache line, which a gap link fills
+#define                 MEM_NODE_HEAP_MAX_BLOCKS          32
+
+static const size_t     MEM_POOL_MAP_THRESHOLD          = 64 << 20; // larger pools are mapped, and committed as touched
+
+#define                 MEM_BITMAP_CHUNK_SIZE             64 // granularity of BITMAP pools
+#define                 MEM_BITMAP_WORD_BITS              64
+static const size_t     MEM_BITMAP_RECORD_INIT_CAPACITY = 64; // records only for live allocations, in blocks
+static const float      MEM_BITMAP_RECORD_SHRINK_FACTOR = 0.25; // as for the node heap
+#define                 MEM_BITMAP_RECORD_MAX_BLOCKS      32
+
+#define                 MEM_QUICK_LISTS                   64 // deferred coalescing: bins of freed blocks by size
+
+#define                 MEM_GROUP_SMALL_STEP              16   // granularity of the small-size lookup
+#define                 MEM_GROUP_SMALL_MAX               4096 // sizes above go by power of two
+
+#ifdef MEM_POOL_PROFILE
+#define MEM_PROFILE_SUB_BUCKETS 4 // latency buckets per power of two
+#define MEM_PROFILE_BUCKETS     (64 * MEM_PROFILE_SUB_BUCKETS)
+#endif
+
+#ifdef MEM_POOL_TRACE
+static const size_t     MEM_TRACE_INIT_CAPACITY         = 64; // a power of two
+static const float      MEM_TRACE_FILL_FACTOR           = 0.5;
+static const unsigned   MEM_TRACE_EXPAND_FACTOR         = 2;
+#endif
 
-static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
-static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
-static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
+#ifdef MEM_POOL_SAMPLE
+static const size_t     MEM_SAMPLE_INIT_CAPACITY        = 64; // a power of two
+static const float      MEM_SAMPLE_FILL_FACTOR          = 0.5;
+static const unsigned   MEM_SAMPLE_EXPAND_FACTOR        = 2;
+#define                 MEM_SAMPLE_MAX_DEPTH              32 // frames kept per sample
+#endif
 
 
 
@@ -37,25 +108,157 @@ static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
 /*********************/
 typedef struct _node {
     alloc_t alloc_record;
-    unsigned used;
-    unsigned allocated;
-    struct _node *next, *prev; // doubly-linked list for gap deletion
+    unsigned char used;
+    unsigned char allocated;
+    unsigned char deferred; // freed onto a quick list, not merged yet
+    unsigned char block; // the node heap block it is in
+    struct _node *next, *prev; // doubly-linked list for gap deletion, next links the free nodes
 } node_t, *node_pt;
 
-typedef struct _gap {
+/*
+ * The gap tree is kept apart from the nodes, one link per node in an array
+ * parallel to each node heap block, so a descent reads only the links: the
+ * gap's size and address are copied in while the node is a gap.
+ */
+typedef struct _gap_link {
     size_t size;
+    const char *mem;
+    size_t gap_min, gap_max; // smallest and largest gap in the subtree
+    struct _gap_link *left, *right; // by address or by size (see _mem_tree_before)
+    struct _gap_link *parent; // so a gap is taken out from where it is, NULL at the root
     node_pt node;
-} gap_t, *gap_pt;
+} gap_link_t, *gap_link_pt;
+
+#ifdef MEM_POOL_TRACE
+typedef struct _trace_handle {
+    alloc_pt alloc; // NULL for an empty slot
+    unsigned long id;
+} trace_handle_t, *trace_handle_pt;
+#endif
 
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
-    unsigned total_nodes;
-    unsigned used_nodes;
-    gap_pt gap_ix;
-    unsigned gap_ix_capacity;
+    node_pt node_heap[MEM_NODE_HEAP_MAX_BLOCKS]; // blocks never move, so nodes (and handles) stay put
+    gap_link_pt gap_links[MEM_NODE_HEAP_MAX_BLOCKS]; // the gap tree links of each block's nodes
+    mem_count_t node_block_size[MEM_NODE_HEAP_MAX_BLOCKS];
+    mem_count_t node_block_used[MEM_NODE_HEAP_MAX_BLOCKS];
+    node_pt free_nodes[MEM_NODE_HEAP_MAX_BLOCKS]; // unused nodes of each block, linked through next
+    unsigned free_blocks; // bit b is set if block b has unused nodes
+    unsigned num_node_blocks;
+    gap_link_pt gap_tree; // root of a treap of the gaps
+    mem_count_t total_nodes;
+    mem_count_t used_nodes;
+    unsigned long long *bitmap; // BITMAP pools: one bit per chunk, set if allocated
+    unsigned long long *bitmap_heads; // and one set at the first chunk of each allocation
+    size_t num_chunks;
+    size_t free_chunks;
+    alloc_pt records[MEM_BITMAP_RECORD_MAX_BLOCKS]; // allocation records, blocks never move
+    size_t record_block_size[MEM_BITMAP_RECORD_MAX_BLOCKS];
+    size_t record_block_used[MEM_BITMAP_RECORD_MAX_BLOCKS];
+    alloc_pt free_records[MEM_BITMAP_RECORD_MAX_BLOCKS]; // unused records of each block, linked through mem
+    unsigned free_record_blocks; // bit b is set if block b has unused records
+    unsigned num_record_blocks;
+    size_t total_records;
+    size_t first_free_word; // no bitmap word below it has a free chunk
+    const pool_engine_t *engine; // of the policy, chosen at open
+    void *engine_state;
+    unsigned store_slot; // position in the pool store
+    node_pt quick_list[MEM_QUICK_LISTS]; // deferred blocks, linked through their own memory
+    size_t quick_size[MEM_QUICK_LISTS]; // the one size each list holds
+    unsigned num_deferred;
+    unsigned max_deferred; // 0 merges on every free
+    size_t granularity; // requests are rounded up to a multiple (a power of two)
+    size_t min_split; // a smaller remainder goes with the allocation, not into a gap
+#ifdef MEM_POOL_HISTOGRAM
+    pool_histogram_t histogram;
+#endif
+#ifdef MEM_POOL_TRACE
+    unsigned trace_id;
+    trace_handle_pt trace_handles; // ids of the handles given out while tracing, open addressing
+    size_t trace_capacity; // a power of two, 0 until the first traced allocation
+    size_t trace_live;
+    unsigned long *trace_free_ids; // ids of freed handles, reused first so ids stay dense
+    unsigned long trace_num_free;
+    unsigned long trace_next_id; // ids handed out so far are below it
+#endif
+#ifdef MEM_POOL_PROFILE
+    pool_profile_t profile;
+    unsigned long alloc_ticks[MEM_PROFILE_BUCKETS];
+    unsigned long del_ticks[MEM_PROFILE_BUCKETS];
+#endif
+#ifdef MEM_POOL_PROBES
+    unsigned long probe_scanned; // by the search of the allocation in progress
+#endif
 } pool_mgr_t, *pool_mgr_pt;
 
+typedef struct _group_mgr {
+    pool_group_t group;
+    unsigned char small_lookup[MEM_GROUP_SMALL_MAX / MEM_GROUP_SMALL_STEP + 1]; // by granule
+    unsigned char large_lookup[64]; // by power of two
+    struct _group_mgr *next, *prev; // open groups, so mem_free can free them
+} group_mgr_t, *group_mgr_pt;
+
+#ifdef MEM_POOL_SAMPLE
+typedef struct _sample {
+    alloc_pt alloc; // NULL for an empty slot
+    pool_mgr_pt pool_mgr;
+    size_t size;
+    unsigned depth;
+    void *stack[MEM_SAMPLE_MAX_DEPTH]; // return addresses, from the caller of mem_new_alloc's sampler up
+} sample_t, *sample_pt;
+#endif
+
+
+
+/**********/
+/*        */
+/* Macros */
+/*        */
+/**********/
+#ifdef MEM_POOL_PROFILE
+#define PROFILE_COUNT(pool_mgr, counter, n)   ((pool_mgr)->profile.counter += (n))
+#define PROFILE_MAX(pool_mgr, counter, n)                                \
+                            do {                                         \
+                                if ((pool_mgr)->profile.counter < (n))   \
+                                    (pool_mgr)->profile.counter = (n);   \
+                            } while (0)
+#else
+#define PROFILE_COUNT(pool_mgr, counter, n)
+#define PROFILE_MAX(pool_mgr, counter, n)     do { } while (0)
+#endif
+
+/*
+ * Static probes of provider mem_pool, nops until a tracer attaches, e.g.
+ *
+ *     bpftrace -e 'usdt:./app:mem_pool:alloc__return { @scanned = hist(arg3); }'
+ *
+ *   pool__open          pool, total size, policy
+ *   pool__close         pool, allocations still in it (closed, destroyed or freed)
+ *   alloc__entry        pool, size
+ *   alloc__return       pool, size, memory (NULL if failed), nodes scanned
+ *   del__alloc          pool, size, memory (only once the pool took the handle back)
+ *   node__heap__resize  pool, old total nodes, new total nodes
+ *   gap__tree__insert   pool, gap size, tree rotations
+ *   gap__tree__remove   pool, gap size, tree rotations
+ *
+ * Nodes scanned are gap tree nodes, 0 for a reused deferred block or
+ * another engine.
+ */
+#ifdef MEM_POOL_PROBES
+#define PROBE2(name, a, b)          DTRACE_PROBE2(mem_pool, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(mem_pool, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(mem_pool, name, a, b, c, d)
+#define PROBE_SCANNED(pool_mgr, n)  ((pool_mgr)->probe_scanned = (n))
+#else
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#define PROBE_SCANNED(pool_mgr, n)
+#endif
+
+#define BITMAP_TEST(bitmap, chunk) \
+                            (((bitmap)[(chunk) / MEM_BITMAP_WORD_BITS] >> ((chunk) % MEM_BITMAP_WORD_BITS)) & 1)
+
 
 
 /***************************/
@@ -64,8 +267,26 @@ typedef struct _pool_mgr {
 /*                         */
 /***************************/
 static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
-static unsigned pool_store_size = 0;
+static unsigned *pool_store_next_free = NULL; // free-slot list, threaded through the empty slots
+static unsigned pool_store_free_head = 0;
+static unsigned pool_store_size = 0; // open pools
 static unsigned pool_store_capacity = 0;
+static pool_engine_t engines[MEM_MAX_ENGINES]; // by policy, the built-in ones first
+static unsigned num_engines = 0;
+static group_mgr_pt group_list = NULL; // open groups, most recent first
+static size_t (*bitmap_skip)(const unsigned long long *, size_t, size_t, unsigned long long) = NULL; // chosen at init
+#ifdef MEM_POOL_TRACE
+static FILE *trace_file = NULL;
+static unsigned trace_next_pool_id = 0; // counts every pool opened, traced or not
+#endif
+#ifdef MEM_POOL_SAMPLE
+static size_t sample_interval = 0; // mean bytes between samples, 0 while not sampling
+static size_t sample_countdown = 0; // bytes to the next sample
+static unsigned long long sample_rng = 0;
+static sample_pt samples = NULL; // live samples by alloc, open addressing with linear probing
+static size_t sample_capacity = 0; // a power of two
+static size_t sample_live = 0;
+#endif
 
 
 
@@ -75,17 +296,148 @@ static unsigned pool_store_capacity = 0;
 /*                                          */
 /********************************************/
 static alloc_status _mem_resize_pool_store();
+static void _mem_pool_release(pool_mgr_pt pool_mgr);
+static alloc_status _mem_pool_closable(pool_mgr_pt pool_mgr);
+static char *_mem_pool_mem_alloc(size_t size);
+static void _mem_pool_mem_free(char *mem, size_t size);
+static alloc_status _mem_node_heap_open(pool_pt pool, void **state);
+static void _mem_node_heap_close(pool_pt pool, void *state);
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
-static alloc_status
-        _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
-                           size_t size,
-                           node_pt node);
-static alloc_status
-        _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
-                                size_t size,
-                                node_pt node);
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, node_pt node);
+static size_t _mem_largest_gap(pool_mgr_pt pool_mgr);
+static unsigned _mem_find_node_block(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_take_node(pool_mgr_pt pool_mgr);
+static void _mem_free_node(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_shrink_node_heap(pool_mgr_pt pool_mgr);
+static gap_link_pt _mem_gap_links_alloc(mem_count_t count);
+static gap_link_pt _mem_gap_link(pool_mgr_pt pool_mgr, node_pt node);
+static unsigned _mem_tree_priority(gap_link_pt x);
+static int _mem_tree_before(int by_size, gap_link_pt a, gap_link_pt b);
+static void _mem_tree_update(gap_link_pt x);
+static void _mem_tree_fix_up(gap_link_pt x);
+static void _mem_tree_replace(pool_mgr_pt pool_mgr, gap_link_pt parent, gap_link_pt old, gap_link_pt x);
+static void _mem_tree_rotate_up(pool_mgr_pt pool_mgr, gap_link_pt x);
+static unsigned _mem_tree_insert(pool_mgr_pt pool_mgr, gap_link_pt x);
+static unsigned _mem_tree_remove(pool_mgr_pt pool_mgr, gap_link_pt x);
+static node_pt _mem_tree_first_fit(pool_mgr_pt pool_mgr, size_t size);
+static node_pt _mem_tree_best_fit(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt
+        _mem_node_heap_alloc(pool_mgr_pt pool_mgr,
+                             size_t size,
+                             node_pt (*find_gap)(pool_mgr_pt, size_t));
+static alloc_pt _mem_first_fit_alloc(pool_pt pool, void *state, size_t size);
+static alloc_pt _mem_best_fit_alloc(pool_pt pool, void *state, size_t size);
+static alloc_status _mem_node_heap_del_alloc(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed);
+static void
+        _mem_node_heap_next_segment(pool_pt pool,
+                                    void *state,
+                                    pool_cursor_pt cursor,
+                                    pool_segment_pt segment);
+static alloc_status _mem_node_heap_stats(pool_pt pool, void *state, pool_stats_pt stats);
+static int
+        _mem_next_segment(pool_mgr_pt pool_mgr,
+                          pool_cursor_pt cursor,
+                          pool_segment_pt segment);
+static alloc_status _mem_coalesce(pool_mgr_pt pool_mgr, node_pt node);
+static unsigned _mem_quick_bin(size_t size);
+static node_pt _mem_quick_pop(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_flush_deferred(pool_mgr_pt pool_mgr);
+static alloc_status _mem_bitmap_grow_records(pool_mgr_pt pool_mgr);
+static unsigned _mem_bitmap_record_block(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_pt _mem_bitmap_take_record(pool_mgr_pt pool_mgr);
+static void _mem_bitmap_free_record(pool_mgr_pt pool_mgr, unsigned b, alloc_pt record);
+static alloc_status _mem_bitmap_open(pool_pt pool, void **state);
+static void _mem_bitmap_close(pool_pt pool, void *state);
+static size_t _mem_bitmap_chunks(size_t size);
+static size_t
+        _mem_bitmap_skip_scalar(const unsigned long long *bitmap,
+                                size_t w,
+                                size_t num_words,
+                                unsigned long long word);
+#ifdef MEM_BITMAP_AVX2
+static size_t
+        _mem_bitmap_skip_avx2(const unsigned long long *bitmap,
+                              size_t w,
+                              size_t num_words,
+                              unsigned long long word);
+#endif
+static size_t
+        _mem_bitmap_find(const unsigned long long *bitmap,
+                         size_t num_chunks,
+                         size_t run,
+                         size_t *first_free_word);
+static size_t
+        _mem_bitmap_next(const unsigned long long *bitmap,
+                         size_t num_chunks,
+                         size_t chunk,
+                         int allocated);
+static void
+        _mem_bitmap_mark(unsigned long long *bitmap,
+                         size_t chunk,
+                         size_t run,
+                         int allocated);
+static alloc_pt _mem_bitmap_alloc(pool_pt pool, void *state, size_t size);
+static alloc_status _mem_bitmap_del_alloc(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed);
+static void
+        _mem_bitmap_next_segment(pool_pt pool,
+                                 void *state,
+                                 pool_cursor_pt cursor,
+                                 pool_segment_pt segment);
+static alloc_status _mem_bitmap_stats(pool_pt pool, void *state, pool_stats_pt stats);
+#ifdef MEM_POOL_HISTOGRAM
+static unsigned _mem_size_class(size_t size);
+#endif
+static unsigned _mem_group_member(group_mgr_pt group_mgr, size_t size);
+static int _mem_may_hold(pool_mgr_pt pool_mgr, alloc_pt alloc);
+#ifdef MEM_POOL_TRACE
+static size_t _mem_trace_slot(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_trace_resize(pool_mgr_pt pool_mgr, size_t capacity);
+static unsigned long _mem_trace_handle_add(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static int _mem_trace_handle_remove(pool_mgr_pt pool_mgr, alloc_pt alloc, unsigned long *id);
+static void _mem_trace_handles_free(pool_mgr_pt pool_mgr);
+static void
+        _mem_trace(trace_op op,
+                   unsigned pool_id,
+                   int num_operands,
+                   unsigned long long operand0,
+                   unsigned long long operand1);
+#endif
+#ifdef MEM_POOL_PROFILE
+static unsigned long long _mem_ticks();
+static void _mem_record_ticks(unsigned long *buckets, unsigned long long ticks);
+static unsigned long long
+        _mem_ticks_percentile(const unsigned long *buckets,
+                              unsigned long count,
+                              double fraction);
+#endif
+#ifdef MEM_POOL_SAMPLE
+static size_t _mem_sample_next();
+static size_t _mem_sample_slot(alloc_pt alloc);
+static alloc_status _mem_sample_resize(size_t capacity);
+static void _mem_sample_take(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static void _mem_sample_drop(alloc_pt alloc);
+static void _mem_sample_drop_pool(pool_mgr_pt pool_mgr);
+#endif
+
+
+
+/********************/
+/*                  */
+/* Built-in engines */
+/*                  */
+/********************/
+static const pool_engine_t MEM_BUILTIN_ENGINES[] = {
+        [FIRST_FIT] = {"first_fit", 0, _mem_node_heap_open, _mem_node_heap_close,
+                       _mem_first_fit_alloc, _mem_node_heap_del_alloc,
+                       _mem_node_heap_next_segment, _mem_node_heap_stats},
+        [BEST_FIT]  = {"best_fit", 0, _mem_node_heap_open, _mem_node_heap_close,
+                       _mem_best_fit_alloc, _mem_node_heap_del_alloc,
+                       _mem_node_heap_next_segment, _mem_node_heap_stats},
+        [BITMAP]    = {"bitmap", MEM_BITMAP_CHUNK_SIZE, _mem_bitmap_open, _mem_bitmap_close,
+                       _mem_bitmap_alloc, _mem_bitmap_del_alloc,
+                       _mem_bitmap_next_segment, _mem_bitmap_stats}
+};
 
 
 
@@ -102,8 +454,36 @@ alloc_status mem_init()
 
     if (pool_store == NULL) {
         pool_store = (pool_mgr_pt*) calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_pt));
+        pool_store_next_free = (unsigned *) malloc(MEM_POOL_STORE_INIT_CAPACITY * sizeof(unsigned));
+        if (pool_store == NULL || pool_store_next_free == NULL) {
+            free(pool_store);
+            free(pool_store_next_free);
+            pool_store = NULL;
+            pool_store_next_free = NULL;
+            return ALLOC_FAIL;
+        }
+
+        // all slots are free, in order
+        for (unsigned u = 0; u < MEM_POOL_STORE_INIT_CAPACITY; ++u) {
+            pool_store_next_free[u] = u + 1;
+        }
+        pool_store_next_free[MEM_POOL_STORE_INIT_CAPACITY - 1] = MEM_POOL_STORE_NO_SLOT;
+        pool_store_free_head = 0;
         pool_store_capacity = MEM_POOL_STORE_INIT_CAPACITY;
         pool_store_size = 0;
+
+        // the built-in engines take the first policies
+        memcpy(engines, MEM_BUILTIN_ENGINES, sizeof(MEM_BUILTIN_ENGINES));
+        num_engines = sizeof(MEM_BUILTIN_ENGINES) / sizeof(pool_engine_t);
+
+        // the widest bitmap scan the CPU has
+        bitmap_skip = _mem_bitmap_skip_scalar;
+#ifdef MEM_BITMAP_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            bitmap_skip = _mem_bitmap_skip_avx2;
+        }
+#endif
         return ALLOC_OK;
     }
 
@@ -115,37 +495,78 @@ alloc_status mem_init()
 alloc_status mem_free()
 {
     // ensure that it's called only once for each mem_init
-    // make sure all pool managers have been deallocated
-    // can free the pool store array
-    // update static variables
-    if(pool_store != NULL) {
-        mem_pool_close(&pool_store[0]->pool);
-    }
+    if(pool_store != NULL);
     else {
         return ALLOC_CALLED_AGAIN;
     }
 
+    // tear down the pools still open, allocations and all, in one pass
+    for (unsigned u = 0; u < pool_store_capacity && pool_store_size > 0; ++u) {
+        if (pool_store[u] != NULL) {
+            _mem_pool_release(pool_store[u]);
+        }
+    }
+
+    // and the groups still open, whose members went with the pools
+    while (group_list != NULL) {
+        group_mgr_pt next = group_list->next;
+        free(group_list);
+        group_list = next;
+    }
+
+    // free the pool store array and update static variables
     free(pool_store);
+    free(pool_store_next_free);
     pool_store = NULL;
+    pool_store_next_free = NULL;
     pool_store_size = 0;
     pool_store_capacity = 0;
+
+    // registered engines go with the pools
+    num_engines = 0;
+    return ALLOC_OK;
+}
+
+alloc_status mem_register_engine(const pool_engine_t *engine, alloc_policy *policy)
+{
+    // engines are registered between mem_init and mem_free
+    if (pool_store == NULL || engine == NULL || policy == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    // open and close are optional, the rest is not
+    if (engine->alloc == NULL || engine->del_alloc == NULL
+        || engine->next_segment == NULL || engine->stats == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    if (num_engines == MEM_MAX_ENGINES) {
+        return ALLOC_FAIL;
+    }
+
+    // keep a copy, under the next policy
+    engines[num_engines] = *engine;
+    *policy = (alloc_policy) num_engines++;
+
     return ALLOC_OK;
 }
 
 pool_pt mem_pool_open(size_t size, alloc_policy policy)
 {
     // make sure there the pool store is allocated
-    if(pool_store_size == 0);
+    if(pool_store != NULL);
     else{
         return NULL;
     }
-    if(pool_store != NULL);
-    else{
+
+    // and that the policy has an engine
+    if ((unsigned) policy >= num_engines) {
         return NULL;
     }
+    const pool_engine_t *engine = &engines[policy];
 
     // expand the pool store, if necessary
-    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR && _mem_resize_pool_store() == ALLOC_FAIL) {
+    if (_mem_resize_pool_store() == ALLOC_FAIL) {
         return NULL;
     }
 
@@ -158,8 +579,16 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy)
         return NULL;
     }
 
+    // pools of a chunked engine are a whole number of chunks, at least one
+    if (engine->chunk_size > 0) {
+        size = (size + engine->chunk_size - 1) / engine->chunk_size * engine->chunk_size;
+        if (size == 0) {
+            size = engine->chunk_size;
+        }
+    }
+
     // allocate a new memory pool
-    pool_mgr->pool.mem = (char*) malloc(size);
+    pool_mgr->pool.mem = _mem_pool_mem_alloc(size);
 
     // check success, on error deallocate mgr and return null
     if (pool_mgr->pool.mem == NULL)
@@ -169,61 +598,56 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy)
         return NULL;
     }
 
-    // allocate a new node heap
-    pool_mgr->node_heap = (node_pt) calloc (MEM_NODE_HEAP_INIT_CAPACITY ,sizeof(node_t));
-
-    // check success, on error deallocate mgr/pool and return null
-    if (pool_mgr->node_heap == NULL)
-    {
-        free(pool_mgr);
-        printf("node heap not allocated");
-        return NULL;
-    }
-
-    // allocate a new gap index
-    pool_mgr->gap_ix = (gap_pt) calloc (MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-
-    // check success, on error deallocate mgr/pool/heap and return null
-    if (pool_mgr->gap_ix == NULL)
-    {
-        free(pool_mgr->node_heap);
-        free(&pool_mgr[0].pool);
-        free(pool_mgr);
-        printf("gap index not allocated");
-        return NULL;
-
-    }
-    // assign all the pointers and update meta data:
-    //   initialize top node of node heap
-    pool_mgr->node_heap[0].alloc_record.mem = pool_mgr->pool.mem;
-    pool_mgr->node_heap[0].alloc_record.size = size;
-    pool_mgr->node_heap[0].next = NULL;
-    pool_mgr->node_heap[0].prev = NULL;
-    pool_mgr->node_heap[0].used = 0;
-    pool_mgr->node_heap[0].allocated = 0;
-
-    //   initialize top node of gap index
-    pool_mgr->gap_ix[0].node = pool_mgr->node_heap;
-    pool_mgr->gap_ix[0].size = size;
-
     //   initialize pool mgr
+    memset(pool_mgr->quick_list, 0, sizeof(pool_mgr->quick_list));
+    memset(pool_mgr->quick_size, 0, sizeof(pool_mgr->quick_size));
+    pool_mgr->num_deferred = 0;
+    pool_mgr->max_deferred = 0;
+    pool_mgr->granularity = 1;
+    pool_mgr->min_split = 0;
     pool_mgr->pool.total_size = size;
     pool_mgr->pool.policy = policy;
-    pool_mgr->used_nodes = 1;
     pool_mgr->pool.num_gaps = 1;
     pool_mgr->pool.alloc_size = 0;
     pool_mgr->pool.num_allocs = 0;
+    pool_mgr->engine = engine;
+    pool_mgr->engine_state = NULL;
 
-    //   link pool mgr to pool store
-    int i = 0;
-    while (pool_store[i] != NULL) {
-        ++i;
+    // let the engine set up its bookkeeping, on error deallocate mgr/pool and return null
+    if (engine->open != NULL && engine->open((pool_pt) pool_mgr, &pool_mgr->engine_state) != ALLOC_OK)
+    {
+        _mem_pool_mem_free(pool_mgr->pool.mem, size);
+        free(pool_mgr);
+        return NULL;
     }
-    pool_store[i] = pool_mgr;
-    pool_store_size = 1;
 
-    pool_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-    pool_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+    //   link pool mgr to pool store, in the first slot of the free list
+    pool_mgr->store_slot = pool_store_free_head;
+    pool_store_free_head = pool_store_next_free[pool_mgr->store_slot];
+    pool_store[pool_mgr->store_slot] = pool_mgr;
+    ++pool_store_size;
+
+#ifdef MEM_POOL_HISTOGRAM
+    memset(&pool_mgr->histogram, 0, sizeof(pool_histogram_t));
+#endif
+#ifdef MEM_POOL_PROFILE
+    memset(&pool_mgr->profile, 0, sizeof(pool_profile_t));
+    memset(pool_mgr->alloc_ticks, 0, sizeof(pool_mgr->alloc_ticks));
+    memset(pool_mgr->del_ticks, 0, sizeof(pool_mgr->del_ticks));
+#endif
+
+#ifdef MEM_POOL_TRACE
+    pool_mgr->trace_handles = NULL;
+    pool_mgr->trace_capacity = 0;
+    pool_mgr->trace_live = 0;
+    pool_mgr->trace_free_ids = NULL;
+    pool_mgr->trace_num_free = 0;
+    pool_mgr->trace_next_id = 0;
+    pool_mgr->trace_id = trace_next_pool_id++;
+    _mem_trace(TRACE_POOL_OPEN, pool_mgr->trace_id, 2, size, policy);
+#endif
+
+    PROBE3(pool__open, pool_mgr, size, policy);
 
     // return the address of the mgr, cast to (pool_pt)
     return (pool_pt) pool_mgr;
@@ -240,372 +664,2298 @@ alloc_status mem_pool_close(pool_pt pool)
         return ALLOC_NOT_FREED;
     }
 
-    // check if pool has only one gap
-    if (pool->num_gaps == 1);
-    else {
-        return ALLOC_NOT_FREED;
-    }
-
-    // check if it has zero allocations
-    if (pool->num_allocs == 0);
-    else {
+    // check if it has only one gap and zero allocations
+    if (_mem_pool_closable(pool_mgr) != ALLOC_OK) {
         return ALLOC_NOT_FREED;
     }
 
-    // free memory pool
-    free(pool);
-
-    // free node heap
-    free(pool_mgr->node_heap);
-
-    // free gap index
-    free(pool_mgr->gap_ix);
-
-    // find mgr in pool store and set to null
-    int i = 0;
-    while (pool_store[i] != pool_mgr) {
-        ++i;
-    }
-    pool_store[i] = NULL;
+    _mem_pool_release(pool_mgr);
     return ALLOC_OK;
 
 }
 
-alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
+alloc_status mem_pool_destroy(pool_pt pool)
+{
     // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    // variables that will be used:
-    pool_mgr_pt poolMgr = (pool_mgr_pt) pool;
-    node_pt newNode = NULL;
-    node_pt newGap = NULL;
-    int i = 0;
-    int j = 0;
-    int remainGap = 0;
-
-
-    // check if any gaps, return null if none
-    if(poolMgr->gap_ix[0].node == NULL){
-        return NULL;
-    }
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-    // expand heap node, if necessary, quit on error
-    if ((poolMgr->used_nodes / poolMgr->total_nodes) > MEM_NODE_HEAP_FILL_FACTOR && _mem_resize_node_heap(poolMgr) != ALLOC_OK) {
-        _mem_resize_node_heap(poolMgr);
+    if (pool_mgr == NULL) {
+        return ALLOC_NOT_FREED;
     }
 
-    if (poolMgr->used_nodes > poolMgr->total_nodes) {
-        return NULL;
-    }
-    // if policy == FIRST_FIT, (node heap)
-    if(poolMgr->pool.policy == FIRST_FIT){
-        while((i < poolMgr->total_nodes) && (poolMgr->node_heap[i].allocated != 0 || poolMgr->node_heap[i].alloc_record.size < size)){
-            ++i;
-        }
-        // check if node found
-        if(i == poolMgr->total_nodes){
-            return NULL;
-        }
-        newNode = &poolMgr->node_heap[i];
+    // one teardown, the allocations go with the pool instead of one by one
+    _mem_pool_release(pool_mgr);
+    return ALLOC_OK;
+}
 
-    }
-        // if policy == BEST_FIT, (gap ix)
-    else if(poolMgr->pool.policy == BEST_FIT){
-        if(poolMgr->pool.num_gaps > 0) {
-            while (i < poolMgr->pool.num_gaps && poolMgr->gap_ix[i + 1].size >= size) {
-                if(poolMgr->gap_ix[i].size == size){
-                    break;
-                }
-                ++i;
-            }
-        }
-        else {
-            return NULL;
-        }
-        newNode = poolMgr->gap_ix[i].node;
-    }
+alloc_pt mem_new_alloc(pool_pt pool, size_t size)
+{
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-    // check if node found
-    if(newNode == NULL){
-        return NULL;
+    PROBE2(alloc__entry, pool, size);
+    PROBE_SCANNED(pool_mgr, 0);
+
+#ifdef MEM_POOL_PROFILE
+    unsigned long long start = _mem_ticks();
+#endif
+
+    // straight to the engine of the policy
+    alloc_pt alloc = pool_mgr->engine->alloc(pool, pool_mgr->engine_state, size);
+
+    PROBE4(alloc__return, pool, size, (alloc != NULL) ? alloc->mem : NULL, pool_mgr->probe_scanned);
+
+#ifdef MEM_POOL_PROFILE
+    ++(pool_mgr->profile.allocs);
+    _mem_record_ticks(pool_mgr->alloc_ticks, _mem_ticks() - start);
+#endif
+
+#ifdef MEM_POOL_HISTOGRAM
+    // count the request in its size class, by the size it was given, as
+    // mem_del_alloc only knows that one
+    if (alloc != NULL) {
+        pool_size_class_pt size_class =
+                &pool_mgr->histogram.classes[_mem_size_class(alloc->size)];
+        ++(size_class->live_allocs);
+        ++(size_class->total_allocs);
+        size_class->live_size += alloc->size;
+        size_class->total_size += alloc->size;
     }
-
-    // update metadata (num_allocs, alloc_size)
-    ++(poolMgr->pool.num_allocs);
-    poolMgr->pool.alloc_size += size;
-
-    // calculate the size of the remaining gap, if any
-    if(newNode->alloc_record.size - size > 0){
-        remainGap = newNode->alloc_record.size - size;
+    else {
+        ++(pool_mgr->histogram.classes[_mem_size_class(size)].failed_allocs);
     }
-    _mem_remove_from_gap_ix(poolMgr, size, newNode);
-
-    // convert gap_node to an allocation node of given size
-    newNode->alloc_record.size = size;
-    newNode->allocated = 1;
-    newNode->used = 1;
+#endif
 
-    // adjust node heap:
-    //   if remaining gap, need a new node
-    if(remainGap != 0) {
-        //   find an unused one in the node heap
-        while (poolMgr->node_heap[j].used != 0) {
-            ++j;
-        }
-        newGap = &poolMgr->node_heap[j];
-        //   make sure one was found
-        if(newGap == NULL){
-            return NULL;
+#ifdef MEM_POOL_SAMPLE
+    // one sample per sample_interval bytes handed out, on average
+    if (alloc != NULL && sample_interval != 0) {
+        if (alloc->size >= sample_countdown) {
+            _mem_sample_take(pool_mgr, alloc);
         }
         else {
-            newGap->alloc_record.size = remainGap;
-            newGap->used = 1;
-            newGap->allocated = 0;
-        }
-        newGap->next = newNode->next;
-
-        //   update linked list (new node right after the node for allocation)
-        if(newNode->next != NULL){
-            newNode->next->prev = newGap;
+            sample_countdown -= alloc->size;
         }
-        ++(poolMgr->used_nodes);
-        newNode->next = newGap;
-        newGap->prev = newNode;
-
+    }
+#endif
 
-        //   add to gap index
-        _mem_add_to_gap_ix(poolMgr, remainGap, newGap);
+#ifdef MEM_POOL_TRACE
+    if (trace_file != NULL) {
+        _mem_trace(TRACE_ALLOC, pool_mgr->trace_id, 2, size,
+                   (alloc != NULL) ? _mem_trace_handle_add(pool_mgr, alloc) : 0);
     }
+#endif
 
-    // return allocation record by casting the node to (alloc_pt)
-    return (alloc_pt) newNode;
+    return alloc;
 }
 
 alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc)
 {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt poolMgr = (pool_mgr_pt) pool;
-    // temporary node pt to check if the node if found
-    node_pt node = (node_pt) alloc;
-    // node that will hold the next node from the node that will be deleted
-    node_pt next = NULL;
-    // prev node from deleteNode
-    node_pt prev = NULL;
-    // this node will be used as a temporary storage
-    node_pt deleteNode = NULL;
-    // find the node in the node heap
-    for(int i = 0; i< poolMgr->total_nodes; ++i){
-        if(node == &poolMgr->node_heap[i]){
-            deleteNode = &poolMgr->node_heap[i];
-            break;
-        }
-    }
-    // make sure it's found
-    if (deleteNode != NULL);
-    else{
-        return ALLOC_FAIL;
-    }
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-    next = deleteNode->next;
-    prev = deleteNode->prev;
-    deleteNode->allocated = 0;
+#ifdef MEM_POOL_PROFILE
+    unsigned long long start = _mem_ticks();
+#endif
 
-    // update metadata (num_allocs, alloc_size)
-    poolMgr->pool.num_allocs--;
-    poolMgr->pool.alloc_size -= deleteNode->alloc_record.size;
+    // only the engine can tell a good handle from a bad one, so the size
+    // comes from the record it freed
+    alloc_t freed;
+    alloc_status status = pool_mgr->engine->del_alloc(pool, pool_mgr->engine_state, alloc, &freed);
 
-    // if the next node in the list is a gap, merge deleteNode to it
-    if(deleteNode->next != NULL && deleteNode->next->allocated == 0) {
-        if(_mem_remove_from_gap_ix(poolMgr, 0, next) == ALLOC_FAIL) {
-            return ALLOC_FAIL;
-        }
-        deleteNode->alloc_record.size += next->alloc_record.size;
-        //   update node as unused
-        next->used = 0;
-        //   update metadata (used nodes)
-        --(poolMgr->used_nodes);
-        //   update linked list:
-        if (next->next) {
-            next->next->prev = deleteNode;
-            deleteNode->next = next->next;
-        } else {
-            deleteNode->next = NULL;
-        }
-        next->next = NULL;
-        next->prev = NULL;
+#ifdef MEM_POOL_PROFILE
+    ++(pool_mgr->profile.dels);
+    _mem_record_ticks(pool_mgr->del_ticks, _mem_ticks() - start);
+#endif
+
+    if (status == ALLOC_OK) {
+        PROBE3(del__alloc, pool, freed.size, freed.mem);
     }
-    // check if the prev node in the list a gap and merges it if it is
-    if(deleteNode->prev!= NULL && deleteNode->prev->allocated == 0) {
-        if(_mem_remove_from_gap_ix(poolMgr, 0, prev) == ALLOC_FAIL) {
-            return ALLOC_FAIL;
-        }
-        prev->alloc_record.size += deleteNode->alloc_record.size;
-        //   update metadata (used_nodes)
-        --(poolMgr->used_nodes);
-        deleteNode->used = 0;
-        //   update linked list
-        if (deleteNode->next) {
-            prev->next = deleteNode->next;
-            deleteNode->next->prev = prev;
-        } else {
-            prev->next = NULL;
-        }
-        deleteNode = prev;
+
+#ifdef MEM_POOL_HISTOGRAM
+    if (status == ALLOC_OK) {
+        pool_size_class_pt size_class =
+                &pool_mgr->histogram.classes[_mem_size_class(freed.size)];
+        --(size_class->live_allocs);
+        size_class->live_size -= freed.size;
     }
-    // check success
-    if (_mem_add_to_gap_ix(poolMgr, deleteNode->alloc_record.size, deleteNode) == ALLOC_OK) {
-        return ALLOC_OK;
+#endif
+
+#ifdef MEM_POOL_TRACE
+    // the id is looked up by the handle's value, and only once the engine took it
+    unsigned long handle_id;
+    if (status == ALLOC_OK && pool_mgr->trace_live > 0
+        && _mem_trace_handle_remove(pool_mgr, alloc, &handle_id)) {
+        _mem_trace(TRACE_DEL_ALLOC, pool_mgr->trace_id, 1, handle_id, 0);
     }
-    else {
-        return ALLOC_FAIL;
+#endif
+
+#ifdef MEM_POOL_SAMPLE
+    if (sample_live > 0 && status == ALLOC_OK) {
+        _mem_sample_drop(alloc);
     }
+#endif
+
+    return status;
 }
 
-void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments)
+void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, mem_count_t *num_segments)
 {
     // get the mgr from the pool
     pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
-    node_pt currNode;
-    pool_segment_pt segmentArr = (pool_segment_pt) calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
-    currNode = pool_mgr->node_heap;
+    pool_cursor_t cursor = {0, NULL};
+    mem_count_t capacity = pool->num_allocs + pool->num_gaps + pool_mgr->num_deferred;
+    mem_count_t n = 0;
 
-    // loop through the node heap and the segments array
-    //    for each node, write the size and allocated in the segment
-    for (int i=0; i < pool_mgr->used_nodes; ++i)
-    {
-        segmentArr[i].size = currNode->alloc_record.size;
-        segmentArr[i].allocated = currNode->allocated;
-        if (currNode->next != NULL)
-            currNode = currNode->next;
+    // one segment per allocation, per gap and per deferred block
+    pool_segment_pt segmentArr = (pool_segment_pt) calloc(capacity, sizeof(pool_segment_t));
+
+    // walk the segments in address order
+    while (n < capacity && _mem_next_segment(pool_mgr, &cursor, &segmentArr[n])) {
+        ++n;
     }
 
     // "return" the values:
     *segments = segmentArr;
-    *num_segments = pool_mgr->used_nodes;
+    *num_segments = n;
 }
 
-
-
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store()
+alloc_status mem_pool_defer_coalescing(pool_pt pool, unsigned max_deferred)
 {
-    // check if necessary
-    /*
-                if (((float) pool_store_size / pool_store_capacity)
-                    > MEM_POOL_STORE_FILL_FACTOR) {...}
-     */
-    // don't forget to update capacity variables
-    if (((float) pool_store_size / pool_store_capacity) > MEM_POOL_STORE_FILL_FACTOR) {
-        // reallocate pool store
-        pool_store = realloc(pool_store, (sizeof(pool_store) * MEM_POOL_STORE_EXPAND_FACTOR));
-        // update pool store capacity
-        pool_store_capacity = pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR;
-        return ALLOC_OK;
-    }
-    else {
-        return ALLOC_FAIL;
-    }
-}
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr)
-{
-    // check if necessary
-    /*
-                if (((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
-                    > MEM_NODE_HEAP_FILL_FACTOR) {...}
-     */
-    // don't forget to update capacity variables
-    if (MEM_NODE_HEAP_FILL_FACTOR > (pool_mgr->used_nodes / pool_mgr->total_nodes)){
+    // only the node heap engines merge gaps on free
+    if (pool_mgr == NULL || (pool->policy != FIRST_FIT && pool->policy != BEST_FIT)) {
         return ALLOC_FAIL;
     }
-    else{
-        pool_mgr->node_heap = realloc(pool_mgr->node_heap, sizeof(pool_mgr->node_heap) * MEM_NODE_HEAP_EXPAND_FACTOR);
-        pool_mgr->total_nodes = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
 
-        return ALLOC_OK;
+    // a lower limit (0 turns deferring off) takes effect right away
+    pool_mgr->max_deferred = max_deferred;
+    if (pool_mgr->num_deferred > max_deferred) {
+        return _mem_flush_deferred(pool_mgr);
     }
-}
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr)
-{
-    // check if necessary
-    /*
-                if (((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
-                    > MEM_GAP_IX_FILL_FACTOR) {...}
-     */
-    // don't forget to update capacity variables
-    if (MEM_GAP_IX_FILL_FACTOR > (pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)) {
-        return ALLOC_FAIL;
-    }
-    else{
-        pool_mgr->gap_ix = realloc(pool_mgr->gap_ix, sizeof(pool_mgr->gap_ix) * MEM_GAP_IX_EXPAND_FACTOR);
-        pool_mgr->gap_ix_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
-        return ALLOC_OK;
-    }
+    return ALLOC_OK;
 }
 
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
+alloc_status mem_pool_tune(pool_pt pool, size_t granularity, size_t min_split)
 {
-    int i = 0;
-    // expand the gap index, if necessary (call the function)
-    _mem_resize_gap_ix(pool_mgr);
-    while (pool_mgr->gap_ix[i].node != NULL) {
-        ++i;
-    }
-    // update metadata (num_gaps)
-    (pool_mgr->pool.num_gaps)++;
-    // add the entry at the end
-    pool_mgr->gap_ix[i].size = size;
-    pool_mgr->gap_ix[i].node = node;
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-    // check success
-    if (pool_mgr->gap_ix[i].node == NULL) {
+    // only the node heap engines split gaps at any size
+    if (pool_mgr == NULL || (pool->policy != FIRST_FIT && pool->policy != BEST_FIT)) {
         return ALLOC_FAIL;
     }
-    else {
-        // sort the gap index (call the function)
-        _mem_sort_gap_ix(pool_mgr);
-        return ALLOC_OK;
-    }
-}
 
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
-{
-    // find the position of the node in the gap index
-    // loop from there to the end of the array:
-    //    pull the entries (i.e. copy over) one position up
-    //    this effectively deletes the chosen node
-    int i = 0;
-    while (pool_mgr->gap_ix[i].node != node) {
-        ++i;
+    // the granularity has to be a power of two
+    if (granularity == 0 || (granularity & (granularity - 1)) != 0) {
+        return ALLOC_FAIL;
     }
 
-    // update metadata (num_gaps)
-    pool_mgr->pool.num_gaps--;
-    // zero out the element at position num_gaps!
-    pool_mgr->gap_ix[i].size = 0;
-    pool_mgr->gap_ix[i].node = NULL;
+    // only later allocations are affected
+    pool_mgr->granularity = granularity;
+    pool_mgr->min_split = min_split;
 
     return ALLOC_OK;
 }
 
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr)
+alloc_status mem_pool_iterate(pool_pt pool, pool_segment_cb callback, void *ctx)
 {
-    // the new entry is at the end, so "bubble it up"
-    // loop from num_gaps - 1 until but not including 0:
-    //    if the size of the current entry is less than the previous (u - 1)
-    //    or if the sizes are the same but the current entry points to a
-    //    node with a lower address of pool allocation address (mem)
-    //       swap them (by copying) (remember to use a temporary variable)
-    gap_t tempNode;
-    int i = pool_mgr->pool.num_gaps - 1;
-    while (pool_mgr->gap_ix[i].size < pool_mgr->gap_ix[i+1].size && i > 0){
-        tempNode = pool_mgr->gap_ix[i];
-        pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i+1];
-        pool_mgr->gap_ix[i+1] = tempNode;
-        --i;
-    }
+    pool_cursor_t cursor = {0, NULL};
+
+    // one unbounded step
+    return mem_pool_iterate_from(pool, &cursor, 0, callback, ctx);
+}
+
+alloc_status mem_pool_iterate_from(pool_pt pool,
+                                   pool_cursor_pt cursor,
+                                   unsigned max_segments,
+                                   pool_segment_cb callback,
+                                   void *ctx)
+{
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    pool_segment_t segment;
+
+    if (pool_mgr == NULL || cursor == NULL || callback == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    // report up to max_segments (0 for all), nothing is copied or allocated
+    for (unsigned n = 0; max_segments == 0 || n < max_segments; ++n) {
+        if (!_mem_next_segment(pool_mgr, cursor, &segment) || callback(&segment, ctx) != 0) {
+            break;
+        }
+    }
+
+    return ALLOC_OK;
+}
+
+
+
+alloc_status mem_pool_histogram(pool_pt pool, pool_histogram_pt histogram)
+{
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || histogram == NULL) {
+        return ALLOC_FAIL;
+    }
+
+#ifdef MEM_POOL_HISTOGRAM
+    *histogram = pool_mgr->histogram;
+    return ALLOC_OK;
+#else
+    memset(histogram, 0, sizeof(pool_histogram_t));
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_profile(pool_pt pool, pool_profile_pt profile)
+{
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || profile == NULL) {
+        return ALLOC_FAIL;
+    }
+
+#ifdef MEM_POOL_PROFILE
+    *profile = pool_mgr->profile;
+
+    // the percentiles are read off the latency histograms on demand
+    profile->alloc_ticks_p50 = _mem_ticks_percentile(pool_mgr->alloc_ticks, profile->allocs, 0.5);
+    profile->alloc_ticks_p99 = _mem_ticks_percentile(pool_mgr->alloc_ticks, profile->allocs, 0.99);
+    profile->alloc_ticks_p999 = _mem_ticks_percentile(pool_mgr->alloc_ticks, profile->allocs, 0.999);
+    profile->del_ticks_p50 = _mem_ticks_percentile(pool_mgr->del_ticks, profile->dels, 0.5);
+    profile->del_ticks_p99 = _mem_ticks_percentile(pool_mgr->del_ticks, profile->dels, 0.99);
+    profile->del_ticks_p999 = _mem_ticks_percentile(pool_mgr->del_ticks, profile->dels, 0.999);
+
+    return ALLOC_OK;
+#else
+    memset(profile, 0, sizeof(pool_profile_t));
+    return ALLOC_FAIL;
+#endif
+}
+
+pool_group_pt mem_group_open(const pool_group_class_t *classes, unsigned num_classes)
+{
+    if (classes == NULL || num_classes == 0 || num_classes > MEM_GROUP_MAX_POOLS) {
+        return NULL;
+    }
+
+    // the classes have to be in ascending order of size
+    for (unsigned c = 1; c < num_classes; ++c) {
+        if (classes[c].max_size <= classes[c - 1].max_size) {
+            return NULL;
+        }
+    }
+
+    group_mgr_pt group_mgr = (group_mgr_pt) calloc(1, sizeof(group_mgr_t));
+    if (group_mgr == NULL) {
+        return NULL;
+    }
+
+    // open a member pool per class, on error close the ones opened
+    for (unsigned c = 0; c < num_classes; ++c) {
+        group_mgr->group.pools[c] = mem_pool_open(classes[c].pool_size, classes[c].policy);
+        if (group_mgr->group.pools[c] == NULL) {
+            for (unsigned d = 0; d < c; ++d) {
+                mem_pool_close(group_mgr->group.pools[d]);
+            }
+            free(group_mgr);
+            return NULL;
+        }
+        group_mgr->group.max_size[c] = classes[c].max_size;
+    }
+    group_mgr->group.num_pools = num_classes;
+
+    // each lookup entry is the first member that takes the smallest size it covers
+    for (unsigned i = 0; i < sizeof(group_mgr->small_lookup); ++i) {
+        size_t smallest = (i == 0) ? 0 : (i - 1) * MEM_GROUP_SMALL_STEP + 1;
+        unsigned m = 0;
+        while (m < num_classes && classes[m].max_size < smallest) {
+            ++m;
+        }
+        group_mgr->small_lookup[i] = (unsigned char) m;
+    }
+    for (unsigned i = 0; i < sizeof(group_mgr->large_lookup); ++i) {
+        size_t smallest = (size_t) 1 << i;
+        unsigned m = 0;
+        while (m < num_classes && classes[m].max_size < smallest) {
+            ++m;
+        }
+        group_mgr->large_lookup[i] = (unsigned char) m;
+    }
+
+    // on the list of open groups
+    group_mgr->next = group_list;
+    if (group_list != NULL) {
+        group_list->prev = group_mgr;
+    }
+    group_list = group_mgr;
+
+    return (pool_group_pt) group_mgr;
+}
+
+alloc_status mem_group_close(pool_group_pt group)
+{
+    if (group == NULL) {
+        return ALLOC_NOT_FREED;
+    }
+
+    group_mgr_pt group_mgr = (group_mgr_pt) group;
+
+    // close all or nothing: every member has to pass mem_pool_close's
+    // checks before any is closed, so the closes don't fail; if one did,
+    // stop there and pass it on
+    for (unsigned m = 0; m < group->num_pools; ++m) {
+        if (_mem_pool_closable((pool_mgr_pt) group->pools[m]) != ALLOC_OK) {
+            return ALLOC_NOT_FREED;
+        }
+    }
+    for (unsigned m = 0; m < group->num_pools; ++m) {
+        if (mem_pool_close(group->pools[m]) != ALLOC_OK) {
+            return ALLOC_NOT_FREED;
+        }
+    }
+
+    // off the list of open groups
+    if (group_mgr->prev != NULL) {
+        group_mgr->prev->next = group_mgr->next;
+    }
+    else {
+        group_list = group_mgr->next;
+    }
+    if (group_mgr->next != NULL) {
+        group_mgr->next->prev = group_mgr->prev;
+    }
+
+    free(group_mgr);
+    return ALLOC_OK;
+}
+
+alloc_pt mem_group_alloc(pool_group_pt group, size_t size)
+{
+    // route to the member for the size, and spill over to larger ones when it's full
+    for (unsigned m = _mem_group_member((group_mgr_pt) group, size); m < group->num_pools; ++m) {
+        alloc_pt alloc = mem_new_alloc(group->pools[m], size);
+        if (alloc != NULL) {
+            return alloc;
+        }
+    }
+
+    return NULL;
+}
+
+alloc_status mem_group_del_alloc(pool_group_pt group, alloc_pt alloc)
+{
+    // the handle is not read until a member took it for one of its own,
+    // so the member is found by where the handle is, not by its size
+    for (unsigned m = 0; m < group->num_pools; ++m) {
+        pool_pt pool = group->pools[m];
+        if (_mem_may_hold((pool_mgr_pt) pool, alloc) && mem_del_alloc(pool, alloc) == ALLOC_OK) {
+            return ALLOC_OK;
+        }
+    }
+
+    return ALLOC_FAIL;
+}
+
+alloc_status mem_trace_open(const char *path)
+{
+#ifdef MEM_POOL_TRACE
+    // one trace at a time
+    if (trace_file != NULL) {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("mem_trace_open");
+        return ALLOC_FAIL;
+    }
+
+    // write the header
+    unsigned char version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace_file);
+    fwrite(&version, 1, 1, trace_file);
+
+    // pools already open keep their ids (which are never reused), and are
+    // opened in the trace as they are now, empty; handle ids from an
+    // earlier trace mean nothing in this one
+    for (unsigned u = 0; u < pool_store_capacity; ++u) {
+        if (pool_store[u] != NULL) {
+            _mem_trace_handles_free(pool_store[u]);
+            _mem_trace(TRACE_POOL_OPEN, pool_store[u]->trace_id, 2,
+                       pool_store[u]->pool.total_size, pool_store[u]->pool.policy);
+        }
+    }
+
+    return ALLOC_OK;
+#else
+    (void) path;
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_trace_close()
+{
+#ifdef MEM_POOL_TRACE
+    if (trace_file == NULL) {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    alloc_status status = (fclose(trace_file) == 0) ? ALLOC_OK : ALLOC_FAIL;
+    trace_file = NULL;
+    return status;
+#else
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_sample_open(size_t interval)
+{
+#ifdef MEM_POOL_SAMPLE
+    // one sampling session at a time
+    if (sample_interval != 0) {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    samples = (sample_pt) calloc(MEM_SAMPLE_INIT_CAPACITY, sizeof(sample_t));
+    if (samples == NULL) {
+        return ALLOC_FAIL;
+    }
+    sample_capacity = MEM_SAMPLE_INIT_CAPACITY;
+    sample_live = 0;
+
+    // an interval of 0 takes the default; a fixed seed, so runs sample the same allocations
+    sample_interval = (interval != 0) ? interval : MEM_SAMPLE_DEFAULT_INTERVAL;
+    sample_rng = 0x853c49e6748fea9bull;
+    sample_countdown = _mem_sample_next();
+
+    return ALLOC_OK;
+#else
+    (void) interval;
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_sample_close()
+{
+#ifdef MEM_POOL_SAMPLE
+    if (sample_interval == 0) {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    // the live samples go too
+    free(samples);
+    samples = NULL;
+    sample_capacity = 0;
+    sample_live = 0;
+    sample_interval = 0;
+
+    return ALLOC_OK;
+#else
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_sample_dump(const char *path)
+{
+#ifdef MEM_POOL_SAMPLE
+    size_t live_size = 0;
+
+    if (sample_interval == 0) {
+        return ALLOC_FAIL;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("mem_sample_dump");
+        return ALLOC_FAIL;
+    }
+
+    // the legacy pprof heap profile: totals, then one line per live sample with
+    // its stack, then the mappings to symbolize against; only live allocations
+    // are tracked, so the in-use and the allocated figures are the same
+    for (size_t s = 0; s < sample_capacity; ++s) {
+        live_size += (samples[s].alloc != NULL) ? samples[s].size : 0;
+    }
+    fprintf(file, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+            (unsigned long) sample_live, (unsigned long) live_size,
+            (unsigned long) sample_live, (unsigned long) live_size,
+            (unsigned long) sample_interval);
+
+    for (size_t s = 0; s < sample_capacity; ++s) {
+        if (samples[s].alloc == NULL) {
+            continue;
+        }
+        fprintf(file, "1: %lu [1: %lu] @",
+                (unsigned long) samples[s].size, (unsigned long) samples[s].size);
+        for (unsigned f = 0; f < samples[s].depth; ++f) {
+            fprintf(file, " %p", samples[s].stack[f]);
+        }
+        fputc('\n', file);
+    }
+
+    // not every system has them
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL) {
+        char buf[4096];
+        size_t n;
+
+        fputs("\nMAPPED_LIBRARIES:\n", file);
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, file);
+        }
+        fclose(maps);
+    }
+
+    return (fclose(file) == 0) ? ALLOC_OK : ALLOC_FAIL;
+#else
+    (void) path;
+    return ALLOC_FAIL;
+#endif
+}
+
+alloc_status mem_pool_stats(pool_pt pool, pool_stats_pt stats)
+{
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || stats == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    return pool_mgr->engine->stats(pool, pool_mgr->engine_state, stats);
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+static alloc_status _mem_node_heap_open(pool_pt pool, void **state)
+{
+    // the node heap lives in the mgr
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    size_t size = pool->total_size;
+    (void) state;
+
+    // allocate a new node heap (its first block)
+    pool_mgr->node_heap[0] = (node_pt) calloc (MEM_NODE_HEAP_INIT_CAPACITY ,sizeof(node_t));
+
+    // check success, on error deallocate and fail
+    if (pool_mgr->node_heap[0] == NULL)
+    {
+        printf("node heap not allocated");
+        return ALLOC_FAIL;
+    }
+
+    // and its gap links
+    pool_mgr->gap_links[0] = _mem_gap_links_alloc(MEM_NODE_HEAP_INIT_CAPACITY);
+    if (pool_mgr->gap_links[0] == NULL)
+    {
+        free(pool_mgr->node_heap[0]);
+        printf("gap links not allocated");
+        return ALLOC_FAIL;
+    }
+    for (mem_count_t u = 0; u < MEM_NODE_HEAP_INIT_CAPACITY; ++u) {
+        pool_mgr->gap_links[0][u].node = &pool_mgr->node_heap[0][u];
+    }
+
+    // assign all the pointers and update meta data:
+    //   initialize top node of node heap
+    pool_mgr->node_heap[0][0].alloc_record.mem = pool_mgr->pool.mem;
+    pool_mgr->node_heap[0][0].alloc_record.size = size;
+    pool_mgr->node_heap[0][0].next = NULL;
+    pool_mgr->node_heap[0][0].prev = NULL;
+    pool_mgr->node_heap[0][0].used = 1;
+    pool_mgr->node_heap[0][0].allocated = 0;
+
+    //   and the root of the gap tree, as the only gap
+    gap_link_pt link = &pool_mgr->gap_links[0][0];
+    link->size = size;
+    link->mem = pool_mgr->pool.mem;
+    link->gap_min = size;
+    link->gap_max = size;
+    pool_mgr->gap_tree = link;
+
+    //   the rest of the nodes are free, the lowest first
+    memset(pool_mgr->free_nodes, 0, sizeof(pool_mgr->free_nodes));
+    for (unsigned u = MEM_NODE_HEAP_INIT_CAPACITY - 1; u > 0; --u) {
+        pool_mgr->node_heap[0][u].next = pool_mgr->free_nodes[0];
+        pool_mgr->free_nodes[0] = &pool_mgr->node_heap[0][u];
+    }
+    pool_mgr->free_blocks = 1;
+
+    pool_mgr->node_block_size[0] = MEM_NODE_HEAP_INIT_CAPACITY;
+    pool_mgr->node_block_used[0] = 1;
+    pool_mgr->num_node_blocks = 1;
+    pool_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+    pool_mgr->used_nodes = 1;
+
+    return ALLOC_OK;
+}
+
+static void _mem_node_heap_close(pool_pt pool, void *state)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    (void) state;
+
+    // free node heap, and the gap links
+    for (unsigned b = 0; b < pool_mgr->num_node_blocks; ++b) {
+        free(pool_mgr->node_heap[b]);
+        free(pool_mgr->gap_links[b]);
+    }
+}
+
+static alloc_pt _mem_first_fit_alloc(pool_pt pool, void *state, size_t size)
+{
+    (void) state;
+
+    // the lowest-addressed gap that fits, down the gap tree
+    return _mem_node_heap_alloc((pool_mgr_pt) pool, size, _mem_tree_first_fit);
+}
+
+static alloc_pt _mem_best_fit_alloc(pool_pt pool, void *state, size_t size)
+{
+    (void) state;
+
+    // the smallest gap that fits, down the gap tree
+    return _mem_node_heap_alloc((pool_mgr_pt) pool, size, _mem_tree_best_fit);
+}
+
+static alloc_pt _mem_node_heap_alloc(pool_mgr_pt poolMgr,
+                                     size_t size,
+                                     node_pt (*find_gap)(pool_mgr_pt, size_t))
+{
+    // variables that will be used:
+    node_pt newNode = NULL;
+    node_pt newGap = NULL;
+    size_t remainGap = 0;
+
+    // round up to the granularity, failing if that overflows
+    if (size > (size_t) -1 - (poolMgr->granularity - 1)) {
+        return NULL;
+    }
+    size = (size + poolMgr->granularity - 1) & ~(poolMgr->granularity - 1);
+
+    // deferred coalescing: reuse a freed block of the same size as is
+    if (poolMgr->num_deferred > 0) {
+        newNode = _mem_quick_pop(poolMgr, size);
+        if (newNode != NULL) {
+            return (alloc_pt) newNode;
+        }
+        // a miss no gap can take merges the deferred blocks first
+        if (poolMgr->pool.num_gaps == 0 || _mem_largest_gap(poolMgr) < size) {
+            _mem_flush_deferred(poolMgr);
+        }
+    }
+
+    // check if any gaps, return null if none
+    if(poolMgr->pool.num_gaps == 0){
+        return NULL;
+    }
+
+    // check if the largest gap fits, so requests under memory pressure fail in O(1)
+    if(_mem_largest_gap(poolMgr) < size){
+        return NULL;
+    }
+
+    // expand heap node, if necessary, quit on error
+    if (_mem_resize_node_heap(poolMgr) != ALLOC_OK) {
+        return NULL;
+    }
+
+    // a split needs a spare node
+    if (poolMgr->used_nodes >= poolMgr->total_nodes) {
+        return NULL;
+    }
+
+    // the gap the engine picks
+    newNode = find_gap(poolMgr, size);
+
+    // check if node found
+    if(newNode == NULL){
+        return NULL;
+    }
+
+    // calculate the size of the remaining gap, if any; one too small
+    // to be worth a node stays with the allocation
+    if(newNode->alloc_record.size > size){
+        remainGap = newNode->alloc_record.size - size;
+    }
+    if(remainGap < poolMgr->min_split){
+        size += remainGap;
+        remainGap = 0;
+    }
+
+    // update metadata (num_allocs, alloc_size)
+    ++(poolMgr->pool.num_allocs);
+    poolMgr->pool.alloc_size += size;
+
+    _mem_remove_from_gap_ix(poolMgr, newNode);
+
+    // convert gap_node to an allocation node of given size
+    newNode->alloc_record.size = size;
+    newNode->allocated = 1;
+    newNode->used = 1;
+
+    // adjust node heap:
+    //   if remaining gap, need a new node
+    if(remainGap != 0) {
+        //   take an unused one off a free list (updates used_nodes)
+        newGap = _mem_take_node(poolMgr);
+        //   make sure one was found
+        if(newGap == NULL){
+            return NULL;
+        }
+        else {
+            newGap->alloc_record.size = remainGap;
+            newGap->alloc_record.mem = newNode->alloc_record.mem + size;
+            newGap->allocated = 0;
+        }
+        newGap->next = newNode->next;
+
+        //   update linked list (new node right after the node for allocation)
+        if(newNode->next != NULL){
+            newNode->next->prev = newGap;
+        }
+        newNode->next = newGap;
+        newGap->prev = newNode;
+
+
+        //   add to gap tree
+        _mem_add_to_gap_ix(poolMgr, newGap);
+    }
+
+    // return allocation record by casting the node to (alloc_pt)
+    return (alloc_pt) newNode;
+}
+
+static alloc_status _mem_node_heap_del_alloc(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed)
+{
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt poolMgr = (pool_mgr_pt) pool;
+    // temporary node pt to check if the node if found
+    node_pt node = (node_pt) alloc;
+    // this node will be used as a temporary storage
+    node_pt deleteNode = NULL;
+    (void) state;
+
+    // find the node in the node heap (only the block needs to be found)
+    unsigned b = _mem_find_node_block(poolMgr, node);
+    if(b < poolMgr->num_node_blocks){
+        if(node->used && node->allocated){
+            deleteNode = node;
+        }
+        PROFILE_COUNT(poolMgr, lookup_visited, b + 1);
+    }
+    // make sure it's found
+    if (deleteNode != NULL);
+    else{
+        return ALLOC_FAIL;
+    }
+
+    // the caller gets the record as it was, the node may be merged away
+    *freed = deleteNode->alloc_record;
+
+    // update metadata (num_allocs, alloc_size)
+    poolMgr->pool.num_allocs--;
+    poolMgr->pool.alloc_size -= deleteNode->alloc_record.size;
+
+    // deferred coalescing: park the block on the quick list for its size,
+    // as long as the list holds that size and the block can hold the link
+    if (poolMgr->max_deferred > 0 && deleteNode->alloc_record.size >= sizeof(node_pt)) {
+        unsigned bin = _mem_quick_bin(deleteNode->alloc_record.size);
+        if (poolMgr->quick_list[bin] == NULL || poolMgr->quick_size[bin] == deleteNode->alloc_record.size) {
+            memcpy(deleteNode->alloc_record.mem, &poolMgr->quick_list[bin], sizeof(node_pt));
+            poolMgr->quick_list[bin] = deleteNode;
+            poolMgr->quick_size[bin] = deleteNode->alloc_record.size;
+            deleteNode->allocated = 0;
+            deleteNode->deferred = 1;
+
+            // merge in a batch once too many are parked
+            if (++(poolMgr->num_deferred) > poolMgr->max_deferred) {
+                return _mem_flush_deferred(poolMgr);
+            }
+            return ALLOC_OK;
+        }
+    }
+
+    return _mem_coalesce(poolMgr, deleteNode);
+}
+
+static alloc_status _mem_coalesce(pool_mgr_pt poolMgr, node_pt deleteNode)
+{
+    // node that will hold the next node from the node that will be deleted
+    node_pt next = deleteNode->next;
+    // prev node from deleteNode
+    node_pt prev = deleteNode->prev;
+
+    deleteNode->allocated = 0;
+
+    // if the next node in the list is a gap, merge deleteNode to it
+    if(deleteNode->next != NULL && deleteNode->next->allocated == 0 && !deleteNode->next->deferred) {
+        if(_mem_remove_from_gap_ix(poolMgr, next) == ALLOC_FAIL) {
+            return ALLOC_FAIL;
+        }
+        deleteNode->alloc_record.size += next->alloc_record.size;
+        //   update linked list:
+        if (next->next) {
+            next->next->prev = deleteNode;
+            deleteNode->next = next->next;
+        } else {
+            deleteNode->next = NULL;
+        }
+        //   update node as unused, and metadata (used nodes)
+        _mem_free_node(poolMgr, next);
+    }
+    // check if the prev node in the list a gap and merges it if it is
+    if(deleteNode->prev!= NULL && deleteNode->prev->allocated == 0 && !deleteNode->prev->deferred) {
+        if(_mem_remove_from_gap_ix(poolMgr, prev) == ALLOC_FAIL) {
+            return ALLOC_FAIL;
+        }
+        prev->alloc_record.size += deleteNode->alloc_record.size;
+        //   update linked list
+        if (deleteNode->next) {
+            prev->next = deleteNode->next;
+            deleteNode->next->prev = prev;
+        } else {
+            prev->next = NULL;
+        }
+        //   update node as unused, and metadata (used_nodes)
+        _mem_free_node(poolMgr, deleteNode);
+        deleteNode = prev;
+    }
+    // check success
+    if (_mem_add_to_gap_ix(poolMgr, deleteNode) == ALLOC_OK) {
+        return ALLOC_OK;
+    }
+    else {
+        return ALLOC_FAIL;
+    }
+}
+
+static unsigned _mem_quick_bin(size_t size)
+{
+    // Fibonacci hashing, the top bits pick the list
+    return (unsigned) ((size * 0x9E3779B97F4A7C15ull) >> (64 - 6)) % MEM_QUICK_LISTS;
+}
+
+static node_pt _mem_quick_pop(pool_mgr_pt pool_mgr, size_t size)
+{
+    unsigned bin = _mem_quick_bin(size);
+    node_pt node = pool_mgr->quick_list[bin];
+
+    if (node == NULL || pool_mgr->quick_size[bin] != size) {
+        return NULL;
+    }
+
+    // unlink, the next block is stored at the start of this one
+    memcpy(&pool_mgr->quick_list[bin], node->alloc_record.mem, sizeof(node_pt));
+    --(pool_mgr->num_deferred);
+
+    node->deferred = 0;
+    node->allocated = 1;
+    ++(pool_mgr->pool.num_allocs);
+    pool_mgr->pool.alloc_size += size;
+
+    return node;
+}
+
+static alloc_status _mem_flush_deferred(pool_mgr_pt pool_mgr)
+{
+    alloc_status status = ALLOC_OK;
+
+    // merge every parked block into the gap tree, as a normal free would have
+    for (unsigned bin = 0; bin < MEM_QUICK_LISTS && pool_mgr->num_deferred > 0; ++bin) {
+        while (pool_mgr->quick_list[bin] != NULL) {
+            node_pt node = pool_mgr->quick_list[bin];
+            memcpy(&pool_mgr->quick_list[bin], node->alloc_record.mem, sizeof(node_pt));
+            --(pool_mgr->num_deferred);
+
+            node->deferred = 0;
+            if (_mem_coalesce(pool_mgr, node) != ALLOC_OK) {
+                status = ALLOC_FAIL;
+            }
+        }
+    }
+
+    return status;
+}
+
+static int _mem_next_segment(pool_mgr_pt pool_mgr,
+                             pool_cursor_pt cursor,
+                             pool_segment_pt segment)
+{
+    if (cursor->offset >= pool_mgr->pool.total_size) {
+        cursor->offset = pool_mgr->pool.total_size;
+        return 0;
+    }
+
+    // the engine sizes the segment, from the cursor on
+    pool_mgr->engine->next_segment((pool_pt) pool_mgr, pool_mgr->engine_state, cursor, segment);
+    cursor->offset += segment->size;
+
+    return 1;
+}
+
+static void _mem_node_heap_next_segment(pool_pt pool,
+                                        void *state,
+                                        pool_cursor_pt cursor,
+                                        pool_segment_pt segment)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    char *start = pool->mem + cursor->offset;
+    node_pt node = (node_pt) cursor->hint;
+    (void) state;
+
+    // the hint is stale if its node was merged away or reused since,
+    // or its block was released
+    if (node == NULL || _mem_find_node_block(pool_mgr, node) == pool_mgr->num_node_blocks
+        || !node->used || node->alloc_record.mem != start) {
+        node = pool_mgr->node_heap[0];
+        while (node->next != NULL && node->alloc_record.mem + node->alloc_record.size <= start) {
+            node = node->next;
+        }
+    }
+    cursor->hint = node->next;
+
+    // a segment the cursor landed inside of is reported from the cursor on
+    segment->allocated = node->allocated;
+    segment->size = node->alloc_record.mem + node->alloc_record.size - start;
+}
+
+static alloc_status _mem_node_heap_stats(pool_pt pool, void *state, pool_stats_pt stats)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    (void) state;
+
+    // the gap tree keeps the extremes at its root
+    stats->smallest_gap = (pool->num_gaps > 0) ? pool_mgr->gap_tree->gap_min : 0;
+    stats->largest_gap = _mem_largest_gap(pool_mgr);
+
+    stats->free_size = pool->total_size - pool->alloc_size;
+    stats->fragmentation = (stats->free_size > 0) ?
+                           1.0 - (double) stats->largest_gap / stats->free_size : 0.0;
+
+    // capacity use of the metadata
+    stats->used_nodes = pool_mgr->used_nodes;
+    stats->total_nodes = pool_mgr->total_nodes;
+    stats->num_gaps = pool->num_gaps;
+    stats->metadata_size = sizeof(pool_mgr_t) + pool_mgr->total_nodes * (sizeof(node_t) + sizeof(gap_link_t));
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_bitmap_grow_records(pool_mgr_pt pool_mgr)
+{
+    // a new block, as large as all the ones before, the first at the initial capacity
+    unsigned b = pool_mgr->num_record_blocks;
+    if (b == MEM_BITMAP_RECORD_MAX_BLOCKS) {
+        return ALLOC_FAIL;
+    }
+    size_t block_size = (b == 0) ? MEM_BITMAP_RECORD_INIT_CAPACITY : pool_mgr->total_records;
+    alloc_pt block = (alloc_pt) calloc(block_size, sizeof(alloc_t));
+    if (block == NULL) {
+        return ALLOC_FAIL;
+    }
+
+    // the new records go on the block's free list, the lowest first
+    pool_mgr->free_records[b] = NULL;
+    for (size_t u = block_size; u > 0; --u) {
+        block[u - 1].mem = (char *) pool_mgr->free_records[b];
+        pool_mgr->free_records[b] = &block[u - 1];
+    }
+    pool_mgr->free_record_blocks |= 1u << b;
+
+    pool_mgr->records[b] = block;
+    pool_mgr->record_block_size[b] = block_size;
+    pool_mgr->record_block_used[b] = 0;
+    ++(pool_mgr->num_record_blocks);
+    pool_mgr->total_records += block_size;
+
+    return ALLOC_OK;
+}
+
+static unsigned _mem_bitmap_record_block(pool_mgr_pt pool_mgr, alloc_pt alloc)
+{
+    // the block holding a pointer that may not be a record, num_record_blocks if none
+    for (unsigned b = 0; b < pool_mgr->num_record_blocks; ++b) {
+        alloc_pt block = pool_mgr->records[b];
+        if (alloc >= block && alloc < block + pool_mgr->record_block_size[b]) {
+            return (((char *) alloc - (char *) block) % sizeof(alloc_t) == 0) ? b : pool_mgr->num_record_blocks;
+        }
+    }
+    return pool_mgr->num_record_blocks;
+}
+
+static alloc_pt _mem_bitmap_take_record(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->free_record_blocks == 0 && _mem_bitmap_grow_records(pool_mgr) != ALLOC_OK) {
+        return NULL;
+    }
+
+    // the lowest block first, so the top one can drain and be released
+    unsigned b = (unsigned) __builtin_ctz(pool_mgr->free_record_blocks);
+    alloc_pt record = pool_mgr->free_records[b];
+    pool_mgr->free_records[b] = (alloc_pt) record->mem;
+    if (pool_mgr->free_records[b] == NULL) {
+        pool_mgr->free_record_blocks &= ~(1u << b);
+    }
+
+    ++(pool_mgr->record_block_used[b]);
+    return record;
+}
+
+static void _mem_bitmap_free_record(pool_mgr_pt pool_mgr, unsigned b, alloc_pt record)
+{
+    // its mem now links the free list, so a stale handle no longer points into the pool
+    record->mem = (char *) pool_mgr->free_records[b];
+    pool_mgr->free_records[b] = record;
+    pool_mgr->free_record_blocks |= 1u << b;
+    --(pool_mgr->record_block_used[b]);
+
+    // only the top block can go, once none of its records are used, and
+    // with the same hysteresis as the node heap; the first always stays
+    while (pool_mgr->num_record_blocks > 1) {
+        unsigned top = pool_mgr->num_record_blocks - 1;
+        if (pool_mgr->record_block_used[top] != 0) {
+            return;
+        }
+        size_t remaining = pool_mgr->total_records - pool_mgr->record_block_size[top];
+        if ((float) pool_mgr->pool.num_allocs / remaining > MEM_BITMAP_RECORD_SHRINK_FACTOR) {
+            return;
+        }
+
+        free(pool_mgr->records[top]);
+        pool_mgr->records[top] = NULL;
+        pool_mgr->free_records[top] = NULL;
+        pool_mgr->free_record_blocks &= ~(1u << top);
+        pool_mgr->total_records = remaining;
+        --(pool_mgr->num_record_blocks);
+    }
+}
+
+static alloc_status _mem_bitmap_open(pool_pt pool, void **state)
+{
+    // the bitmaps and the records live in the mgr
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    size_t num_chunks = pool->total_size / MEM_BITMAP_CHUNK_SIZE;
+    size_t num_words = (num_chunks + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+
+    pool_mgr->bitmap = (unsigned long long *) calloc(num_words, sizeof(unsigned long long));
+    pool_mgr->bitmap_heads = (unsigned long long *) calloc(num_words, sizeof(unsigned long long));
+    if (pool_mgr->bitmap == NULL || pool_mgr->bitmap_heads == NULL) {
+        free(pool_mgr->bitmap);
+        free(pool_mgr->bitmap_heads);
+        printf("bitmap not allocated");
+        return ALLOC_FAIL;
+    }
+
+    // the records are kept out of band, so a chunk is all payload, and
+    // there is one per live allocation, not per chunk
+    pool_mgr->num_record_blocks = 0;
+    pool_mgr->free_record_blocks = 0;
+    pool_mgr->total_records = 0;
+    if (_mem_bitmap_grow_records(pool_mgr) != ALLOC_OK) {
+        free(pool_mgr->bitmap);
+        free(pool_mgr->bitmap_heads);
+        printf("bitmap records not allocated");
+        return ALLOC_FAIL;
+    }
+
+    // the bits past the last chunk read as allocated, so no run crosses the end
+    if (num_chunks % MEM_BITMAP_WORD_BITS != 0) {
+        pool_mgr->bitmap[num_words - 1] = ~0ull << (num_chunks % MEM_BITMAP_WORD_BITS);
+    }
+    pool_mgr->num_chunks = num_chunks;
+    pool_mgr->free_chunks = num_chunks;
+    pool_mgr->first_free_word = 0;
+    (void) state;
+
+    return ALLOC_OK;
+}
+
+static void _mem_bitmap_close(pool_pt pool, void *state)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    (void) state;
+
+    // free bitmaps and record blocks
+    free(pool_mgr->bitmap);
+    free(pool_mgr->bitmap_heads);
+    for (unsigned b = 0; b < pool_mgr->num_record_blocks; ++b) {
+        free(pool_mgr->records[b]);
+    }
+}
+
+
+static size_t _mem_bitmap_chunks(size_t size)
+{
+    size_t num_chunks = (size + MEM_BITMAP_CHUNK_SIZE - 1) / MEM_BITMAP_CHUNK_SIZE;
+    return (num_chunks > 0) ? num_chunks : 1;
+}
+
+static size_t _mem_bitmap_skip_scalar(const unsigned long long *bitmap,
+                                      size_t w,
+                                      size_t num_words,
+                                      unsigned long long word)
+{
+    // the first word from w on that isn't the given one, num_words if none
+    while (w < num_words && bitmap[w] == word) {
+        ++w;
+    }
+    return w;
+}
+
+#ifdef MEM_BITMAP_AVX2
+__attribute__((target("avx2")))
+static size_t _mem_bitmap_skip_avx2(const unsigned long long *bitmap,
+                                    size_t w,
+                                    size_t num_words,
+                                    unsigned long long word)
+{
+    // four words to a compare, the first lane that differs from its mask;
+    // the words short of a whole vector go the scalar way
+    __m256i words = _mm256_set1_epi64x((long long) word);
+    for ( ; w + 4 <= num_words; w += 4) {
+        __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *) (bitmap + w)), words);
+        unsigned mask = (unsigned) _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+        if (mask != 0xf) {
+            return w + (size_t) __builtin_ctz(~mask);
+        }
+    }
+    return _mem_bitmap_skip_scalar(bitmap, w, num_words, word);
+}
+#endif
+
+static size_t _mem_bitmap_find(const unsigned long long *bitmap,
+                               size_t num_chunks,
+                               size_t run,
+                               size_t *first_free_word)
+{
+    size_t num_words = (num_chunks + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+    size_t carry = 0; // free chunks at the top of the words before, always < run
+
+    // the words below the hint are full, so no run starts in them; the
+    // search moves the hint up past any full words it finds there
+    size_t w = bitmap_skip(bitmap, *first_free_word, num_words, ~0ull);
+    *first_free_word = w;
+
+    for ( ; w < num_words; ++w) {
+        unsigned long long free_bits = ~bitmap[w];
+
+        // full words break any run, skip them all
+        if (free_bits == 0) {
+            carry = 0;
+            w = bitmap_skip(bitmap, w, num_words, ~0ull) - 1;
+            continue;
+        }
+
+        // a run that started in the words before comes first
+        if (carry > 0 && run - carry <= MEM_BITMAP_WORD_BITS) {
+            unsigned long long mask = (run - carry == MEM_BITMAP_WORD_BITS) ?
+                                      ~0ull : (1ull << (run - carry)) - 1;
+            if ((free_bits & mask) == mask) {
+                return w * MEM_BITMAP_WORD_BITS - carry;
+            }
+        }
+
+        // a run within the word: bit j of starts survives if bits j..j+run-1 are free
+        if (run <= MEM_BITMAP_WORD_BITS && (size_t) __builtin_popcountll(free_bits) >= run) {
+            unsigned long long starts = free_bits;
+            for (size_t len = 1; len < run; ) {
+                size_t step = (len < run - len) ? len : run - len;
+                starts &= starts >> step;
+                len += step;
+            }
+            if (starts != 0) {
+                return w * MEM_BITMAP_WORD_BITS + __builtin_ctzll(starts);
+            }
+        }
+
+        // the free chunks at the top carry over into the next word
+        carry = (free_bits == ~0ull) ? carry + MEM_BITMAP_WORD_BITS
+                                     : (size_t) __builtin_clzll(~free_bits);
+    }
+
+    return num_chunks;
+}
+
+static size_t _mem_bitmap_next(const unsigned long long *bitmap,
+                               size_t num_chunks,
+                               size_t chunk,
+                               int allocated)
+{
+    // the first chunk from chunk on that is allocated (or free), a word at a time
+    size_t w = chunk / MEM_BITMAP_WORD_BITS;
+    size_t num_words = (num_chunks + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+    unsigned long long bits = (allocated ? bitmap[w] : ~bitmap[w])
+                              & (~0ull << (chunk % MEM_BITMAP_WORD_BITS));
+
+    // past it, the words with nothing to find are skipped all at once
+    if (bits == 0) {
+        w = bitmap_skip(bitmap, w + 1, num_words, allocated ? 0 : ~0ull);
+        if (w == num_words) {
+            return num_chunks;
+        }
+        bits = allocated ? bitmap[w] : ~bitmap[w];
+    }
+
+    // the padding past the last chunk is set, so clamp to the end
+    chunk = w * MEM_BITMAP_WORD_BITS + __builtin_ctzll(bits);
+    return (chunk < num_chunks) ? chunk : num_chunks;
+}
+
+static void _mem_bitmap_mark(unsigned long long *bitmap,
+                             size_t chunk,
+                             size_t run,
+                             int allocated)
+{
+    // a word at a time
+    while (run > 0) {
+        size_t offset = chunk % MEM_BITMAP_WORD_BITS;
+        size_t n = (MEM_BITMAP_WORD_BITS - offset < run) ? MEM_BITMAP_WORD_BITS - offset : run;
+        unsigned long long mask = (n == MEM_BITMAP_WORD_BITS) ? ~0ull : ((1ull << n) - 1) << offset;
+
+        if (allocated) {
+            bitmap[chunk / MEM_BITMAP_WORD_BITS] |= mask;
+        }
+        else {
+            bitmap[chunk / MEM_BITMAP_WORD_BITS] &= ~mask;
+        }
+        chunk += n;
+        run -= n;
+    }
+}
+
+static alloc_pt _mem_bitmap_alloc(pool_pt pool, void *state, size_t size)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    (void) state;
+
+    // the user memory starts on the first chunk, which is marked as a head
+    if (size > pool_mgr->pool.total_size) {
+        return NULL;
+    }
+    size_t run = _mem_bitmap_chunks(size);
+    size_t chunk = _mem_bitmap_find(pool_mgr->bitmap, pool_mgr->num_chunks, run, &pool_mgr->first_free_word);
+    if (chunk == pool_mgr->num_chunks) {
+        return NULL;
+    }
+    alloc_pt alloc = _mem_bitmap_take_record(pool_mgr);
+    if (alloc == NULL) {
+        return NULL;
+    }
+
+    _mem_bitmap_mark(pool_mgr->bitmap, chunk, run, 1);
+    pool_mgr->bitmap_heads[chunk / MEM_BITMAP_WORD_BITS] |= 1ull << (chunk % MEM_BITMAP_WORD_BITS);
+
+    // the run came out of a gap, which may leave a gap on either side
+    if (chunk > 0 && !BITMAP_TEST(pool_mgr->bitmap, chunk - 1)) {
+        ++(pool_mgr->pool.num_gaps);
+    }
+    if (chunk + run < pool_mgr->num_chunks && !BITMAP_TEST(pool_mgr->bitmap, chunk + run)) {
+        ++(pool_mgr->pool.num_gaps);
+    }
+    --(pool_mgr->pool.num_gaps);
+
+    ++(pool_mgr->pool.num_allocs);
+    pool_mgr->pool.alloc_size += size;
+    pool_mgr->free_chunks -= run;
+
+    alloc->size = size;
+    alloc->mem = pool_mgr->pool.mem + chunk * MEM_BITMAP_CHUNK_SIZE;
+
+    return alloc;
+}
+
+static alloc_status _mem_bitmap_del_alloc(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    unsigned b = _mem_bitmap_record_block(pool_mgr, alloc);
+    (void) state;
+
+    // the handle has to be a used record, whose memory starts at a head chunk
+    if (b == pool_mgr->num_record_blocks) {
+        return ALLOC_FAIL;
+    }
+    uintptr_t offset = (uintptr_t) alloc->mem - (uintptr_t) pool_mgr->pool.mem;
+    if (offset >= pool_mgr->num_chunks * MEM_BITMAP_CHUNK_SIZE || offset % MEM_BITMAP_CHUNK_SIZE != 0) {
+        return ALLOC_FAIL;
+    }
+    size_t chunk = offset / MEM_BITMAP_CHUNK_SIZE;
+    if (!BITMAP_TEST(pool_mgr->bitmap_heads, chunk) || alloc->size > pool_mgr->pool.total_size) {
+        return ALLOC_FAIL;
+    }
+    size_t run = _mem_bitmap_chunks(alloc->size);
+    if (chunk + run > pool_mgr->num_chunks) {
+        return ALLOC_FAIL;
+    }
+
+    _mem_bitmap_mark(pool_mgr->bitmap, chunk, run, 0);
+    pool_mgr->bitmap_heads[chunk / MEM_BITMAP_WORD_BITS] &= ~(1ull << (chunk % MEM_BITMAP_WORD_BITS));
+    if (chunk / MEM_BITMAP_WORD_BITS < pool_mgr->first_free_word) {
+        pool_mgr->first_free_word = chunk / MEM_BITMAP_WORD_BITS;
+    }
+
+    // the run becomes a gap, merged with the gaps on either side
+    ++(pool_mgr->pool.num_gaps);
+    if (chunk > 0 && !BITMAP_TEST(pool_mgr->bitmap, chunk - 1)) {
+        --(pool_mgr->pool.num_gaps);
+    }
+    if (chunk + run < pool_mgr->num_chunks && !BITMAP_TEST(pool_mgr->bitmap, chunk + run)) {
+        --(pool_mgr->pool.num_gaps);
+    }
+
+    *freed = *alloc;
+    --(pool_mgr->pool.num_allocs);
+    pool_mgr->pool.alloc_size -= alloc->size;
+    pool_mgr->free_chunks += run;
+
+    _mem_bitmap_free_record(pool_mgr, b, alloc);
+
+    return ALLOC_OK;
+}
+
+static void _mem_bitmap_next_segment(pool_pt pool,
+                                     void *state,
+                                     pool_cursor_pt cursor,
+                                     pool_segment_pt segment)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    size_t chunk = cursor->offset / MEM_BITMAP_CHUNK_SIZE;
+    size_t next;
+    (void) state;
+
+    if (!BITMAP_TEST(pool_mgr->bitmap, chunk)) {
+        next = _mem_bitmap_next(pool_mgr->bitmap, pool_mgr->num_chunks, chunk, 1);
+    }
+    else {
+        // an allocation ends at a free chunk or at the head of the next one
+        next = _mem_bitmap_next(pool_mgr->bitmap, pool_mgr->num_chunks, chunk, 0);
+        if (chunk + 1 < next) {
+            size_t head = _mem_bitmap_next(pool_mgr->bitmap_heads, pool_mgr->num_chunks, chunk + 1, 1);
+            next = (head < next) ? head : next;
+        }
+    }
+
+    // a segment the cursor landed inside of is reported from the cursor on
+    segment->allocated = BITMAP_TEST(pool_mgr->bitmap, chunk);
+    segment->size = next * MEM_BITMAP_CHUNK_SIZE - cursor->offset;
+}
+
+static alloc_status _mem_bitmap_stats(pool_pt pool, void *state, pool_stats_pt stats)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    size_t num_words = (pool_mgr->num_chunks + MEM_BITMAP_WORD_BITS - 1) / MEM_BITMAP_WORD_BITS;
+    size_t largest = 0, smallest = 0;
+    (void) state;
+
+    // the free size is kept as chunks come and go, but there is no gap
+    // tree, so the gap extremes take a walk of the free runs
+    for (size_t chunk = 0; chunk < pool_mgr->num_chunks; ) {
+        if (BITMAP_TEST(pool_mgr->bitmap, chunk)) {
+            chunk = _mem_bitmap_next(pool_mgr->bitmap, pool_mgr->num_chunks, chunk, 0);
+            continue;
+        }
+        size_t end = _mem_bitmap_next(pool_mgr->bitmap, pool_mgr->num_chunks, chunk, 1);
+        if (end - chunk > largest) {
+            largest = end - chunk;
+        }
+        if (smallest == 0 || end - chunk < smallest) {
+            smallest = end - chunk;
+        }
+        chunk = end;
+    }
+
+    stats->largest_gap = largest * MEM_BITMAP_CHUNK_SIZE;
+    stats->smallest_gap = smallest * MEM_BITMAP_CHUNK_SIZE;
+    stats->free_size = pool_mgr->free_chunks * MEM_BITMAP_CHUNK_SIZE;
+    stats->fragmentation = (stats->free_size > 0) ?
+                           1.0 - (double) stats->largest_gap / stats->free_size : 0.0;
+    stats->used_nodes = 0;
+    stats->total_nodes = 0;
+    stats->num_gaps = pool->num_gaps;
+    stats->metadata_size = sizeof(pool_mgr_t) + 2 * num_words * sizeof(unsigned long long)
+                           + pool_mgr->total_records * sizeof(alloc_t);
+
+    return ALLOC_OK;
+}
+
+
+static alloc_status _mem_resize_pool_store()
+{
+    // check if necessary
+    if (((float) pool_store_size / pool_store_capacity) <= MEM_POOL_STORE_FILL_FACTOR
+        && pool_store_free_head != MEM_POOL_STORE_NO_SLOT) {
+        return ALLOC_OK;
+    }
+
+    unsigned capacity = pool_store_capacity * MEM_POOL_STORE_EXPAND_FACTOR;
+
+    // reallocate pool store and its free-slot list
+    pool_mgr_pt *store = (pool_mgr_pt *) realloc(pool_store, capacity * sizeof(pool_mgr_pt));
+    if (store == NULL) {
+        return ALLOC_FAIL;
+    }
+    pool_store = store;
+
+    unsigned *next_free = (unsigned *) realloc(pool_store_next_free, capacity * sizeof(unsigned));
+    if (next_free == NULL) {
+        return ALLOC_FAIL;
+    }
+    pool_store_next_free = next_free;
+
+    // the new slots go in front of the free list
+    for (unsigned u = pool_store_capacity; u < capacity; ++u) {
+        pool_store[u] = NULL;
+        pool_store_next_free[u] = u + 1;
+    }
+    pool_store_next_free[capacity - 1] = pool_store_free_head;
+    pool_store_free_head = pool_store_capacity;
+
+    // update pool store capacity
+    pool_store_capacity = capacity;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_pool_closable(pool_mgr_pt pool_mgr)
+{
+    // merge the deferred blocks, so an empty pool is one gap again
+    if (_mem_flush_deferred(pool_mgr) != ALLOC_OK) {
+        return ALLOC_NOT_FREED;
+    }
+
+    // then it can close with one gap and no allocations
+    if (pool_mgr->pool.num_gaps != 1 || pool_mgr->pool.num_allocs != 0) {
+        return ALLOC_NOT_FREED;
+    }
+    return ALLOC_OK;
+}
+
+static void _mem_pool_release(pool_mgr_pt pool_mgr)
+{
+    PROBE2(pool__close, pool_mgr, pool_mgr->pool.num_allocs);
+
+#ifdef MEM_POOL_TRACE
+    _mem_trace(TRACE_POOL_CLOSE, pool_mgr->trace_id, 0, 0, 0);
+    _mem_trace_handles_free(pool_mgr);
+#endif
+#ifdef MEM_POOL_SAMPLE
+    // samples of allocations that go with the pool
+    if (sample_live > 0) {
+        _mem_sample_drop_pool(pool_mgr);
+    }
+#endif
+
+    // let the engine free its bookkeeping
+    if (pool_mgr->engine->close != NULL) {
+        pool_mgr->engine->close((pool_pt) pool_mgr, pool_mgr->engine_state);
+    }
+
+    // free memory pool
+    _mem_pool_mem_free(pool_mgr->pool.mem, pool_mgr->pool.total_size);
+
+    // give the slot in the pool store back to the free list
+    pool_store[pool_mgr->store_slot] = NULL;
+    pool_store_next_free[pool_mgr->store_slot] = pool_store_free_head;
+    pool_store_free_head = pool_mgr->store_slot;
+    --pool_store_size;
+
+    // free mgr
+    free(pool_mgr);
+}
+
+static char *_mem_pool_mem_alloc(size_t size)
+{
+    // aligned to a chunk, so the chunks of a bitmap pool are too
+    if (size < MEM_POOL_MAP_THRESHOLD) {
+        void *mem = NULL;
+        return (posix_memalign(&mem, MEM_BITMAP_CHUNK_SIZE, size) == 0) ? (char *) mem : NULL;
+    }
+
+    // without a reservation, pages are only committed once allocations touch them
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (mem == MAP_FAILED) ? NULL : (char *) mem;
+}
+
+static void _mem_pool_mem_free(char *mem, size_t size)
+{
+    if (size < MEM_POOL_MAP_THRESHOLD) {
+        free(mem);
+    }
+    else {
+        munmap(mem, size);
+    }
+}
+
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr)
+{
+    // check if necessary
+    if (((float) pool_mgr->used_nodes / pool_mgr->total_nodes) <= MEM_NODE_HEAP_FILL_FACTOR) {
+        return ALLOC_OK;
+    }
+    if (pool_mgr->num_node_blocks == MEM_NODE_HEAP_MAX_BLOCKS) {
+        return ALLOC_FAIL;
+    }
+
+    // add a block instead of reallocating: nodes are linked to each other,
+    // and into the gap tree, and handed out as allocation records, so
+    // they must never move
+    mem_count_t block_size = pool_mgr->total_nodes * (MEM_NODE_HEAP_EXPAND_FACTOR - 1);
+    if (block_size > (mem_count_t) -1 - pool_mgr->total_nodes) {
+        return ALLOC_FAIL; // out of node indices, see MEM_POOL_WIDE
+    }
+    node_pt block = (node_pt) calloc(block_size, sizeof(node_t));
+    if (block == NULL) {
+        return ALLOC_FAIL;
+    }
+    gap_link_pt links = _mem_gap_links_alloc(block_size);
+    if (links == NULL) {
+        free(block);
+        return ALLOC_FAIL;
+    }
+
+    // the new nodes go on the block's free list, the lowest first
+    unsigned b = pool_mgr->num_node_blocks;
+    pool_mgr->free_nodes[b] = NULL;
+    for (mem_count_t u = block_size; u > 0; --u) {
+        block[u - 1].block = (unsigned char) b;
+        links[u - 1].node = &block[u - 1];
+        block[u - 1].next = pool_mgr->free_nodes[b];
+        pool_mgr->free_nodes[b] = &block[u - 1];
+    }
+    pool_mgr->free_blocks |= 1u << b;
+
+    // don't forget to update capacity variables
+    pool_mgr->node_heap[b] = block;
+    pool_mgr->gap_links[b] = links;
+    pool_mgr->node_block_size[b] = block_size;
+    pool_mgr->node_block_used[b] = 0;
+    ++(pool_mgr->num_node_blocks);
+    pool_mgr->total_nodes += block_size;
+
+    PROBE3(node__heap__resize, pool_mgr, pool_mgr->total_nodes - block_size, pool_mgr->total_nodes);
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, node_pt node)
+{
+    // into the gap tree, keyed by the node's size (which is the gap's)
+    // or address; every node has a link, so there is nothing to grow
+    gap_link_pt link = _mem_gap_link(pool_mgr, node);
+    link->size = node->alloc_record.size;
+    link->mem = node->alloc_record.mem;
+    unsigned rotations = _mem_tree_insert(pool_mgr, link);
+    PROBE3(gap__tree__insert, pool_mgr, node->alloc_record.size, rotations);
+    (void) rotations; // without probes, nothing reads it
+
+    // update metadata (num_gaps)
+    (pool_mgr->pool.num_gaps)++;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, node_pt node)
+{
+    // the node has to be a gap in this pool's tree; it is taken out where
+    // it is, through its parent link, with no search from the root
+    if (pool_mgr->pool.num_gaps == 0 || node->allocated) {
+        return ALLOC_FAIL;
+    }
+    unsigned rotations = _mem_tree_remove(pool_mgr, _mem_gap_link(pool_mgr, node));
+    PROBE3(gap__tree__remove, pool_mgr, node->alloc_record.size, rotations);
+    (void) rotations; // without probes, nothing reads it
+
+    // update metadata (num_gaps)
+    pool_mgr->pool.num_gaps--;
+
+    return ALLOC_OK;
+}
+
+static unsigned _mem_find_node_block(pool_mgr_pt pool_mgr, node_pt node)
+{
+    // the block holding a pointer that may not be a node, num_node_blocks if none
+    for (unsigned b = 0; b < pool_mgr->num_node_blocks; ++b) {
+        node_pt block = pool_mgr->node_heap[b];
+        if (node >= block && node < block + pool_mgr->node_block_size[b]) {
+            return (((char *) node - (char *) block) % sizeof(node_t) == 0) ? b : pool_mgr->num_node_blocks;
+        }
+    }
+    return pool_mgr->num_node_blocks;
+}
+
+static node_pt _mem_take_node(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->free_blocks == 0) {
+        return NULL;
+    }
+
+    // the lowest block first, so the top one can drain and be released
+    unsigned b = (unsigned) __builtin_ctz(pool_mgr->free_blocks);
+    node_pt node = pool_mgr->free_nodes[b];
+    pool_mgr->free_nodes[b] = node->next;
+    if (pool_mgr->free_nodes[b] == NULL) {
+        pool_mgr->free_blocks &= ~(1u << b);
+    }
+
+    node->used = 1;
+    node->next = NULL;
+    ++(pool_mgr->node_block_used[b]);
+    ++(pool_mgr->used_nodes);
+    return node;
+}
+
+static void _mem_free_node(pool_mgr_pt pool_mgr, node_pt node)
+{
+    // unlinked from the pool already, put it on its block's free list
+    unsigned b = node->block;
+    node->used = 0;
+    node->prev = NULL;
+    node->next = pool_mgr->free_nodes[b];
+    pool_mgr->free_nodes[b] = node;
+    pool_mgr->free_blocks |= 1u << b;
+    --(pool_mgr->node_block_used[b]);
+    --(pool_mgr->used_nodes);
+
+    _mem_shrink_node_heap(pool_mgr);
+}
+
+static void _mem_shrink_node_heap(pool_mgr_pt pool_mgr)
+{
+    // only the top block can go, once none of its nodes are used; the
+    // first block holds the head of the list and always stays. The gap
+    // links go with their nodes, so this shrinks the gap tree as well
+    while (pool_mgr->num_node_blocks > 1) {
+        unsigned b = pool_mgr->num_node_blocks - 1;
+        if (pool_mgr->node_block_used[b] != 0) {
+            return;
+        }
+
+        // hysteresis: keep it unless the rest would be well below the fill
+        // factor, so a pool hovering at a block boundary doesn't thrash
+        mem_count_t remaining = pool_mgr->total_nodes - pool_mgr->node_block_size[b];
+        if ((float) pool_mgr->used_nodes / remaining > MEM_NODE_HEAP_SHRINK_FACTOR) {
+            return;
+        }
+
+        // its free nodes are on its own list, so nothing is moved or relinked
+        free(pool_mgr->node_heap[b]);
+        free(pool_mgr->gap_links[b]);
+        pool_mgr->node_heap[b] = NULL;
+        pool_mgr->gap_links[b] = NULL;
+        pool_mgr->free_nodes[b] = NULL;
+        pool_mgr->free_blocks &= ~(1u << b);
+        PROBE3(node__heap__resize, pool_mgr, pool_mgr->total_nodes, remaining);
+        pool_mgr->total_nodes = remaining;
+        --(pool_mgr->num_node_blocks);
+    }
+}
+
+static gap_link_pt _mem_gap_links_alloc(mem_count_t count)
+{
+    // cache-line aligned, so a descent touches one line per level
+    void *links = NULL;
+    if (posix_memalign(&links, MEM_GAP_LINK_ALIGNMENT, count * sizeof(gap_link_t)) != 0) {
+        return NULL;
+    }
+    memset(links, 0, count * sizeof(gap_link_t));
+    return (gap_link_pt) links;
+}
+
+static gap_link_pt _mem_gap_link(pool_mgr_pt pool_mgr, node_pt node)
+{
+    // the link array is parallel to the node's block
+    unsigned b = node->block;
+    return &pool_mgr->gap_links[b][node - pool_mgr->node_heap[b]];
+}
+
+/*
+ * The gap tree is a treap of the gap links. FIRST_FIT keys it by address,
+ * so an in-order walk visits the gaps from the lowest address up; BEST_FIT
+ * keys it by size, then address, so the first gap that fits is the best.
+ * Each link also keeps the largest gap in its subtree, which is all the
+ * first-fit descent needs, and the smallest, for the stats.
+ */
+static unsigned _mem_tree_priority(gap_link_pt x)
+{
+    // treap: a parent's is never lower; a hash of the link's address keeps
+    // it out of the cache line
+    return (unsigned) (((unsigned long long) (uintptr_t) x * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static int _mem_tree_before(int by_size, gap_link_pt a, gap_link_pt b)
+{
+    if (by_size && a->size != b->size) {
+        return a->size < b->size;
+    }
+
+    // a zero-size gap can share its address with the next gap, so the
+    // link's own address breaks ties and keeps the keys distinct
+    return a->mem < b->mem || (a->mem == b->mem && a < b);
+}
+
+static void _mem_tree_update(gap_link_pt x)
+{
+    size_t gap_min = x->size;
+    size_t gap_max = x->size;
+    if (x->left != NULL) {
+        gap_min = (x->left->gap_min < gap_min) ? x->left->gap_min : gap_min;
+        gap_max = (x->left->gap_max > gap_max) ? x->left->gap_max : gap_max;
+    }
+    if (x->right != NULL) {
+        gap_min = (x->right->gap_min < gap_min) ? x->right->gap_min : gap_min;
+        gap_max = (x->right->gap_max > gap_max) ? x->right->gap_max : gap_max;
+    }
+    x->gap_min = gap_min;
+    x->gap_max = gap_max;
+}
+
+static void _mem_tree_fix_up(gap_link_pt x)
+{
+    // once a subtree's extremes come out the same, the ones above can't change
+    while (x != NULL) {
+        size_t gap_min = x->gap_min;
+        size_t gap_max = x->gap_max;
+        _mem_tree_update(x);
+        if (x->gap_min == gap_min && x->gap_max == gap_max) {
+            return;
+        }
+        x = x->parent;
+    }
+}
+
+static void _mem_tree_replace(pool_mgr_pt pool_mgr, gap_link_pt parent, gap_link_pt old, gap_link_pt x)
+{
+    // x (which may be NULL) takes old's place under parent, or at the root
+    if (parent == NULL) {
+        pool_mgr->gap_tree = x;
+    }
+    else if (parent->left == old) {
+        parent->left = x;
+    }
+    else {
+        parent->right = x;
+    }
+    if (x != NULL) {
+        x->parent = parent;
+    }
+}
+
+static void _mem_tree_rotate_up(pool_mgr_pt pool_mgr, gap_link_pt x)
+{
+    // x takes its parent's place, and the parent becomes its child
+    gap_link_pt parent = x->parent;
+    PROFILE_COUNT(pool_mgr, rotations, 1);
+    _mem_tree_replace(pool_mgr, parent->parent, parent, x);
+
+    if (parent->left == x) {
+        parent->left = x->right;
+        if (x->right != NULL) {
+            x->right->parent = parent;
+        }
+        x->right = parent;
+    }
+    else {
+        parent->right = x->left;
+        if (x->left != NULL) {
+            x->left->parent = parent;
+        }
+        x->left = parent;
+    }
+    parent->parent = x;
+
+    _mem_tree_update(parent);
+    _mem_tree_update(x);
+}
+
+static unsigned _mem_tree_insert(pool_mgr_pt pool_mgr, gap_link_pt x)
+{
+    int by_size = (pool_mgr->pool.policy == BEST_FIT);
+    gap_link_pt parent = NULL;
+    gap_link_pt below = pool_mgr->gap_tree;
+    unsigned rotations = 0;
+
+    // down to a leaf by key
+    while (below != NULL) {
+        parent = below;
+        below = _mem_tree_before(by_size, x, parent) ? parent->left : parent->right;
+    }
+    x->left = NULL;
+    x->right = NULL;
+    x->parent = parent;
+    _mem_tree_update(x);
+    if (parent == NULL) {
+        pool_mgr->gap_tree = x;
+    }
+    else if (_mem_tree_before(by_size, x, parent)) {
+        parent->left = x;
+    }
+    else {
+        parent->right = x;
+    }
+
+    // rotate x up while its priority is higher, then widen the extremes above
+    while (x->parent != NULL && _mem_tree_priority(x) > _mem_tree_priority(x->parent)) {
+        _mem_tree_rotate_up(pool_mgr, x);
+        ++rotations;
+    }
+    _mem_tree_fix_up(x->parent);
+
+    return rotations;
+}
+
+static unsigned _mem_tree_remove(pool_mgr_pt pool_mgr, gap_link_pt x)
+{
+    unsigned rotations = 0;
+
+    // rotate x down, below its higher-priority child, until it has at most
+    // one; a treap expects fewer than two of these rotations
+    while (x->left != NULL && x->right != NULL) {
+        _mem_tree_rotate_up(pool_mgr, (_mem_tree_priority(x->left) > _mem_tree_priority(x->right)) ?
+                                      x->left : x->right);
+        ++rotations;
+    }
+
+    // its child takes its place, and only the extremes above that change
+    gap_link_pt parent = x->parent;
+    _mem_tree_replace(pool_mgr, parent, x, (x->left != NULL) ? x->left : x->right);
+    x->left = NULL;
+    x->right = NULL;
+    x->parent = NULL;
+    _mem_tree_fix_up(parent);
+
+    return rotations;
+}
+
+static node_pt _mem_tree_first_fit(pool_mgr_pt pool_mgr, size_t size)
+{
+    gap_link_pt x = pool_mgr->gap_tree;
+    unsigned long visited = 0;
+
+    if (x == NULL || x->gap_max < size) {
+        return NULL;
+    }
+
+    // go left whenever a gap there fits, as it is lower
+    for (;;) {
+        ++visited;
+        if (x->left != NULL && x->left->gap_max >= size) {
+            x = x->left;
+        }
+        else if (x->size >= size) {
+            break;
+        }
+        else {
+            x = x->right;
+        }
+    }
+
+    PROFILE_COUNT(pool_mgr, nodes_visited, visited);
+    PROFILE_MAX(pool_mgr, max_nodes_visited, visited);
+    PROBE_SCANNED(pool_mgr, visited);
+    return x->node;
+}
+
+static node_pt _mem_tree_best_fit(pool_mgr_pt pool_mgr, size_t size)
+{
+    gap_link_pt x = pool_mgr->gap_tree;
+    gap_link_pt fit = NULL;
+    unsigned long visited = 0;
+
+    // keyed by size, so the last gap that fits on the way down is the smallest
+    while (x != NULL) {
+        ++visited;
+        if (x->size >= size) {
+            fit = x;
+            x = x->left;
+        }
+        else {
+            x = x->right;
+        }
+    }
+
+    PROFILE_COUNT(pool_mgr, gaps_visited, visited);
+    PROFILE_MAX(pool_mgr, max_gaps_visited, visited);
+    PROBE_SCANNED(pool_mgr, visited);
+    return (fit != NULL) ? fit->node : NULL;
+}
+
+static size_t _mem_largest_gap(pool_mgr_pt pool_mgr)
+{
+    // the gap tree keeps it at the root
+    return (pool_mgr->gap_tree != NULL) ? pool_mgr->gap_tree->gap_max : 0;
+}
+
+#ifdef MEM_POOL_HISTOGRAM
+static unsigned _mem_size_class(size_t size)
+{
+    // floor(log2(size)), with sizes 0 and 1 both in class 0
+    if (size <= 1) {
+        return 0;
+    }
+#if defined(__GNUC__)
+    return (unsigned) (sizeof(unsigned long long) * 8 - 1
+                       - __builtin_clzll((unsigned long long) size));
+#else
+    unsigned size_class = 0;
+    while (size >>= 1) {
+        ++size_class;
+    }
+    return size_class;
+#endif
+}
+#endif
+
+#ifdef MEM_POOL_PROFILE
+static unsigned long long _mem_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void _mem_record_ticks(unsigned long *buckets, unsigned long long ticks)
+{
+    // log-linear buckets: the power of two, then the next bits below the top one
+    unsigned bucket = (unsigned) ticks;
+    if (ticks >= MEM_PROFILE_SUB_BUCKETS) {
+        unsigned log2 = 0;
+        while ((ticks >> log2) >= 2 * MEM_PROFILE_SUB_BUCKETS) {
+            ++log2;
+        }
+        bucket = (log2 + 1) * MEM_PROFILE_SUB_BUCKETS
+                 + (unsigned) (ticks >> log2) - MEM_PROFILE_SUB_BUCKETS;
+    }
+    if (bucket >= MEM_PROFILE_BUCKETS) {
+        bucket = MEM_PROFILE_BUCKETS - 1;
+    }
+    ++(buckets[bucket]);
+}
+
+static unsigned long long
+_mem_ticks_percentile(const unsigned long *buckets, unsigned long count, double fraction)
+{
+    // walk the buckets until the fraction is covered, report the bucket's upper bound
+    unsigned long target = (unsigned long) (fraction * count);
+    unsigned long seen = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    for (unsigned bucket = 0; bucket < MEM_PROFILE_BUCKETS; ++bucket) {
+        seen += buckets[bucket];
+        if (seen > target) {
+            if (bucket < MEM_PROFILE_SUB_BUCKETS) {
+                return bucket;
+            }
+            unsigned log2 = bucket / MEM_PROFILE_SUB_BUCKETS - 1;
+            unsigned long long sub = bucket % MEM_PROFILE_SUB_BUCKETS + MEM_PROFILE_SUB_BUCKETS;
+            return ((sub + 1) << log2) - 1;
+        }
+    }
+    return ~0ull;
+}
+#endif
+
+static unsigned _mem_group_member(group_mgr_pt group_mgr, size_t size)
+{
+    // the lookup lands on the member for the smallest size of the granule (or power of two),
+    // then steps over any member boundaries inside it
+    unsigned m = (size <= MEM_GROUP_SMALL_MAX) ?
+                 group_mgr->small_lookup[(size + MEM_GROUP_SMALL_STEP - 1) / MEM_GROUP_SMALL_STEP] :
+                 group_mgr->large_lookup[63 - __builtin_clzll(size)];
+
+    while (m < group_mgr->group.num_pools && group_mgr->group.max_size[m] < size) {
+        ++m;
+    }
+    return m;
+}
+
+static int _mem_may_hold(pool_mgr_pt pool_mgr, alloc_pt alloc)
+{
+    // from the handle's address alone: a node of the node heap, or a
+    // record of a bitmap pool; only a registered engine can say for its own
+    switch (pool_mgr->pool.policy) {
+        case FIRST_FIT:
+        case BEST_FIT:
+            return _mem_find_node_block(pool_mgr, (node_pt) alloc) < pool_mgr->num_node_blocks;
+        case BITMAP:
+            return _mem_bitmap_record_block(pool_mgr, alloc) < pool_mgr->num_record_blocks;
+        default:
+            return 1;
+    }
+}
+
+#ifdef MEM_POOL_TRACE
+static size_t _mem_trace_slot(pool_mgr_pt pool_mgr, alloc_pt alloc)
+{
+    return (size_t) (((uintptr_t) alloc * 0x9e3779b97f4a7c15ull) >> 32) & (pool_mgr->trace_capacity - 1);
+}
+
+static alloc_status _mem_trace_resize(pool_mgr_pt pool_mgr, size_t capacity)
+{
+    // there are never more ids than the most handles live at once, so the
+    // free ids fit in as many entries as the table has
+    unsigned long *free_ids = (unsigned long *) realloc(pool_mgr->trace_free_ids,
+                                                        capacity * sizeof(unsigned long));
+    if (free_ids == NULL) {
+        return ALLOC_FAIL;
+    }
+    pool_mgr->trace_free_ids = free_ids;
+
+    // rehash into a new table
+    trace_handle_pt old = pool_mgr->trace_handles;
+    size_t old_capacity = pool_mgr->trace_capacity;
+
+    trace_handle_pt table = (trace_handle_pt) calloc(capacity, sizeof(trace_handle_t));
+    if (table == NULL) {
+        return ALLOC_FAIL;
+    }
+    pool_mgr->trace_handles = table;
+    pool_mgr->trace_capacity = capacity;
+
+    for (size_t t = 0; t < old_capacity; ++t) {
+        if (old[t].alloc == NULL) {
+            continue;
+        }
+        size_t slot = _mem_trace_slot(pool_mgr, old[t].alloc);
+        while (table[slot].alloc != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        table[slot] = old[t];
+    }
+
+    free(old);
+    return ALLOC_OK;
+}
+
+static unsigned long _mem_trace_handle_add(pool_mgr_pt pool_mgr, alloc_pt alloc)
+{
+    // expand if above the fill factor, record the allocation as failed if that fails
+    if (pool_mgr->trace_capacity == 0
+        || (float) (pool_mgr->trace_live + 1) / pool_mgr->trace_capacity > MEM_TRACE_FILL_FACTOR) {
+        size_t capacity = (pool_mgr->trace_capacity == 0) ?
+                          MEM_TRACE_INIT_CAPACITY : pool_mgr->trace_capacity * MEM_TRACE_EXPAND_FACTOR;
+        if (_mem_trace_resize(pool_mgr, capacity) != ALLOC_OK) {
+            return 0;
+        }
+    }
+
+    size_t slot = _mem_trace_slot(pool_mgr, alloc);
+    while (pool_mgr->trace_handles[slot].alloc != NULL) {
+        slot = (slot + 1) & (pool_mgr->trace_capacity - 1);
+    }
+
+    // the id of the last freed handle, or a new one
+    trace_handle_pt handle = &pool_mgr->trace_handles[slot];
+    handle->alloc = alloc;
+    handle->id = (pool_mgr->trace_num_free > 0) ?
+                 pool_mgr->trace_free_ids[--(pool_mgr->trace_num_free)] : (pool_mgr->trace_next_id)++;
+    ++(pool_mgr->trace_live);
+
+    return handle->id + 1;
+}
+
+static int _mem_trace_handle_remove(pool_mgr_pt pool_mgr, alloc_pt alloc, unsigned long *id)
+{
+    size_t mask = pool_mgr->trace_capacity - 1;
+    size_t hole = _mem_trace_slot(pool_mgr, alloc);
+    trace_handle_pt table = pool_mgr->trace_handles;
+
+    // handles given out before the trace started have no id
+    while (table[hole].alloc != alloc) {
+        if (table[hole].alloc == NULL) {
+            return 0;
+        }
+        hole = (hole + 1) & mask;
+    }
+    *id = table[hole].id;
+    pool_mgr->trace_free_ids[(pool_mgr->trace_num_free)++] = *id;
+
+    // pull later handles of the run back over the hole, as for the samples
+    for (size_t t = (hole + 1) & mask; table[t].alloc != NULL; t = (t + 1) & mask) {
+        size_t home = _mem_trace_slot(pool_mgr, table[t].alloc);
+        if (((t - home) & mask) >= ((t - hole) & mask)) {
+            table[hole] = table[t];
+            hole = t;
+        }
+    }
+    table[hole].alloc = NULL;
+    --(pool_mgr->trace_live);
+
+    return 1;
+}
+
+static void _mem_trace_handles_free(pool_mgr_pt pool_mgr)
+{
+    free(pool_mgr->trace_handles);
+    free(pool_mgr->trace_free_ids);
+    pool_mgr->trace_handles = NULL;
+    pool_mgr->trace_capacity = 0;
+    pool_mgr->trace_live = 0;
+    pool_mgr->trace_free_ids = NULL;
+    pool_mgr->trace_num_free = 0;
+    pool_mgr->trace_next_id = 0;
+}
+
+static void _mem_trace(trace_op op,
+                       unsigned pool_id,
+                       int num_operands,
+                       unsigned long long operand0,
+                       unsigned long long operand1)
+{
+    unsigned char record[1 + 3 * TRACE_MAX_VARINT];
+    size_t n = 0;
+
+    if (trace_file == NULL) {
+        return;
+    }
+
+    record[n++] = (unsigned char) op;
+    n += trace_put_varint(record + n, pool_id);
+    if (num_operands > 0) {
+        n += trace_put_varint(record + n, operand0);
+    }
+    if (num_operands > 1) {
+        // the policy of a pool open is a single byte, the rest are varints
+        if (op == TRACE_POOL_OPEN) {
+            record[n++] = (unsigned char) operand1;
+        }
+        else {
+            n += trace_put_varint(record + n, operand1);
+        }
+    }
+
+    fwrite(record, 1, n, trace_file);
+}
+#endif
+
+#ifdef MEM_POOL_SAMPLE
+static size_t _mem_sample_next()
+{
+    // exponential with mean sample_interval, so samples are a Poisson process
+    // over the bytes and pprof can scale them back: -ln(u) * interval for u
+    // uniform in (0, 1], with log2 of the mantissa from a quadratic fit
+    sample_rng = sample_rng * 6364136223846793005ull + 1442695040888963407ull;
+    unsigned long long q = (sample_rng >> 38) + 1; // in [1, 2^26]
+    int e = 63 - __builtin_clzll(q);
+    double m = (double) q / (double) (1ull << e) - 1.0;
+    double log2_q = e + m * (1.3465 - 0.3465 * m);
+
+    return (size_t) ((26.0 - log2_q) * 0.6931471805599453 * (double) sample_interval) + 1;
+}
+
+static size_t _mem_sample_slot(alloc_pt alloc)
+{
+    return (size_t) (((uintptr_t) alloc * 0x9e3779b97f4a7c15ull) >> 32) & (sample_capacity - 1);
+}
+
+static alloc_status _mem_sample_resize(size_t capacity)
+{
+    // rehash into a new table
+    sample_pt old = samples;
+    size_t old_capacity = sample_capacity;
+
+    sample_pt table = (sample_pt) calloc(capacity, sizeof(sample_t));
+    if (table == NULL) {
+        return ALLOC_FAIL;
+    }
+    samples = table;
+    sample_capacity = capacity;
+    sample_live = 0;
+
+    for (size_t s = 0; s < old_capacity; ++s) {
+        if (old[s].alloc == NULL) {
+            continue;
+        }
+        size_t slot = _mem_sample_slot(old[s].alloc);
+        while (samples[slot].alloc != NULL) {
+            slot = (slot + 1) & (sample_capacity - 1);
+        }
+        samples[slot] = old[s];
+        ++sample_live;
+    }
+
+    free(old);
     return ALLOC_OK;
 }
+
+static void _mem_sample_take(pool_mgr_pt pool_mgr, alloc_pt alloc)
+{
+    void *frames[MEM_SAMPLE_MAX_DEPTH + 1];
+
+    sample_countdown = _mem_sample_next();
+
+    // expand if above the fill factor, skip the sample if that fails
+    if ((float) (sample_live + 1) / sample_capacity > MEM_SAMPLE_FILL_FACTOR
+        && _mem_sample_resize(sample_capacity * MEM_SAMPLE_EXPAND_FACTOR) != ALLOC_OK) {
+        return;
+    }
+
+    size_t slot = _mem_sample_slot(alloc);
+    while (samples[slot].alloc != NULL) {
+        slot = (slot + 1) & (sample_capacity - 1);
+    }
+
+    // leave out this frame
+    int depth = backtrace(frames, MEM_SAMPLE_MAX_DEPTH + 1);
+    sample_pt sample = &samples[slot];
+    sample->alloc = alloc;
+    sample->pool_mgr = pool_mgr;
+    sample->size = alloc->size;
+    sample->depth = (depth > 1) ? (unsigned) depth - 1 : 0;
+    memcpy(sample->stack, frames + 1, sample->depth * sizeof(void *));
+    ++sample_live;
+}
+
+static void _mem_sample_drop(alloc_pt alloc)
+{
+    size_t mask = sample_capacity - 1;
+    size_t hole = _mem_sample_slot(alloc);
+
+    // most frees are of allocations that were not sampled
+    while (samples[hole].alloc != alloc) {
+        if (samples[hole].alloc == NULL) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    // pull later samples of the run back over the hole, where their home slot
+    // allows, so no probe stops short of them
+    for (size_t s = (hole + 1) & mask; samples[s].alloc != NULL; s = (s + 1) & mask) {
+        size_t home = _mem_sample_slot(samples[s].alloc);
+        if (((s - home) & mask) >= ((s - hole) & mask)) {
+            samples[hole] = samples[s];
+            hole = s;
+        }
+    }
+    samples[hole].alloc = NULL;
+    --sample_live;
+}
+
+static void _mem_sample_drop_pool(pool_mgr_pt pool_mgr)
+{
+    // a drop only pulls samples back into the slot it empties, so recheck that one
+    for (size_t s = 0; s < sample_capacity && sample_live > 0; ++s) {
+        while (samples[s].alloc != NULL && samples[s].pool_mgr == pool_mgr) {
+            _mem_sample_drop(samples[s].alloc);
+        }
+    }
+}
+#endif
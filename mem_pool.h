@@ -7,17 +7,31 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* compile-time options */
+
+//#define MEM_POOL_WIDE // define for 64-bit counts and indices, for pools of billions of allocations
+
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+#ifdef MEM_POOL_WIDE
+typedef unsigned long long mem_count_t;
+#else
+typedef unsigned mem_count_t;
+#endif
+
+typedef enum _alloc_policy { FIRST_FIT, BEST_FIT, BITMAP } alloc_policy; // registered engines follow BITMAP
 
 typedef struct _pool {
     char *mem;
     alloc_policy policy;
     size_t total_size;
     size_t alloc_size;
-    unsigned num_allocs;
-    unsigned num_gaps;
+    mem_count_t num_allocs;
+    mem_count_t num_gaps;
 } pool_t, *pool_pt;
 
 typedef struct _alloc {
@@ -30,6 +44,69 @@ typedef struct _pool_segment {
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+typedef int (*pool_segment_cb)(const pool_segment_t *segment, void *ctx); // non-zero stops the walk
+
+typedef struct _pool_cursor {
+    size_t offset;               // of the next segment from pool->mem, total_size when done
+    void *hint;                  // where the walk left off, checked before use
+} pool_cursor_t, *pool_cursor_pt;
+
+typedef struct _pool_stats {
+    size_t largest_gap;
+    size_t smallest_gap;
+    size_t free_size;            // total_size - alloc_size (free chunks for BITMAP)
+    double fragmentation;        // external: 1 - largest_gap / free_size
+    mem_count_t used_nodes;
+    mem_count_t total_nodes;     // node heap capacity
+    mem_count_t num_gaps;        // in the gap tree, which lives in the nodes, so total_nodes bounds it too
+    size_t metadata_size;        // bytes held by the pool manager and node heap (or bitmaps and records)
+} pool_stats_t, *pool_stats_pt;
+
+#define MEM_NUM_SIZE_CLASSES 64 // class c counts allocation sizes in [2^c, 2^(c+1)), 0 and 1 in class 0
+
+typedef struct _pool_size_class {
+    unsigned long live_allocs;
+    unsigned long total_allocs;  // cumulative
+    unsigned long failed_allocs;
+    size_t live_size;
+    size_t total_size;           // cumulative
+} pool_size_class_t, *pool_size_class_pt;
+
+typedef struct _pool_histogram {
+    pool_size_class_t classes[MEM_NUM_SIZE_CLASSES];
+} pool_histogram_t, *pool_histogram_pt;
+
+typedef struct _pool_profile {
+    unsigned long allocs;             // timed mem_new_alloc calls
+    unsigned long dels;               // timed mem_del_alloc calls
+    unsigned long nodes_visited;      // gap tree descent (FIRST_FIT)
+    unsigned long max_nodes_visited;
+    unsigned long gaps_visited;       // gap tree descent (BEST_FIT)
+    unsigned long max_gaps_visited;
+    unsigned long lookup_visited;     // node lookup in mem_del_alloc
+    unsigned long rotations;          // gap tree rotations on add and remove
+    unsigned long long alloc_ticks_p50;
+    unsigned long long alloc_ticks_p99;
+    unsigned long long alloc_ticks_p999;
+    unsigned long long del_ticks_p50;
+    unsigned long long del_ticks_p99;
+    unsigned long long del_ticks_p999;
+} pool_profile_t, *pool_profile_pt;
+
+#define MEM_GROUP_MAX_POOLS 16
+
+typedef struct _pool_group_class {
+    size_t max_size;             // largest request routed to this member, (size_t) -1 for any
+    size_t pool_size;
+    alloc_policy policy;
+} pool_group_class_t, *pool_group_class_pt;
+
+typedef struct _pool_group {
+    pool_pt pools[MEM_GROUP_MAX_POOLS];  // by ascending max_size
+    size_t max_size[MEM_GROUP_MAX_POOLS];
+    unsigned num_pools;
+} pool_group_t, *pool_group_pt;
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
@@ -37,6 +114,33 @@ typedef enum _alloc_status {
     ALLOC_NOT_FREED
 } alloc_status;
 
+#define MEM_MAX_ENGINES 16 // built-in and registered
+
+#define MEM_SAMPLE_DEFAULT_INTERVAL (512 * 1024) // bytes handed out between samples, on average
+
+/*
+ * An allocation engine, chosen by the policy a pool is opened with.
+ *
+ * The pool memory and total_size are set up before open, with one gap and
+ * no allocations. The engine keeps alloc_size, num_allocs and num_gaps of
+ * the pool current, and an empty pool has to be one gap again to close.
+ * state is whatever open left there (NULL if there is no open).
+ * Registered engines last until mem_free().
+ */
+typedef struct _pool_engine {
+    const char *name;
+    size_t chunk_size;           // pool sizes are rounded up to whole chunks, 0 for as is
+    alloc_status (*open)(pool_pt pool, void **state);  // optional
+    void (*close)(pool_pt pool, void *state);          // optional
+    alloc_pt (*alloc)(pool_pt pool, void *state, size_t size);
+    // on success, freed gets a copy of the record, which may not outlive the call
+    alloc_status (*del_alloc)(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed);
+    // the segment at cursor->offset (< total_size), from there to its end;
+    // the cursor hint is the engine's to use
+    void (*next_segment)(pool_pt pool, void *state, pool_cursor_pt cursor, pool_segment_pt segment);
+    alloc_status (*stats)(pool_pt pool, void *state, pool_stats_pt stats);
+} pool_engine_t, *pool_engine_pt;
+
 /* function declarations */
 
 alloc_status
@@ -45,12 +149,18 @@ mem_init();
 alloc_status
 mem_free();
 
+alloc_status
+mem_register_engine(const pool_engine_t *engine, alloc_policy *policy);
+
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
 alloc_status
 mem_pool_close(pool_pt pool);
 
+alloc_status
+mem_pool_destroy(pool_pt pool);
+
 alloc_pt
 mem_new_alloc(pool_pt pool, size_t size);
 
@@ -58,6 +168,64 @@ alloc_status
 mem_del_alloc(pool_pt pool, alloc_pt alloc);
 
 void
-mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
+mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, mem_count_t *num_segments);
+
+alloc_status
+mem_pool_defer_coalescing(pool_pt pool, unsigned max_deferred);
+
+alloc_status
+mem_pool_tune(pool_pt pool, size_t granularity, size_t min_split);
+
+alloc_status
+mem_pool_iterate(pool_pt pool, pool_segment_cb callback, void *ctx);
+
+alloc_status
+mem_pool_iterate_from(pool_pt pool,
+                      pool_cursor_pt cursor,
+                      unsigned max_segments,
+                      pool_segment_cb callback,
+                      void *ctx);
+
+// constant time, but a BITMAP pool finds its largest and smallest gap
+// by walking its bitmap, O(chunks / 64 + gaps)
+alloc_status
+mem_pool_stats(pool_pt pool, pool_stats_pt stats);
+
+alloc_status
+mem_pool_histogram(pool_pt pool, pool_histogram_pt histogram);
+
+alloc_status
+mem_pool_profile(pool_pt pool, pool_profile_pt profile);
+
+pool_group_pt
+mem_group_open(const pool_group_class_t *classes, unsigned num_classes);
+
+alloc_status
+mem_group_close(pool_group_pt group);
+
+alloc_pt
+mem_group_alloc(pool_group_pt group, size_t size);
+
+alloc_status
+mem_group_del_alloc(pool_group_pt group, alloc_pt alloc);
+
+alloc_status
+mem_trace_open(const char *path);
+
+alloc_status
+mem_trace_close();
+
+alloc_status
+mem_sample_open(size_t interval);
+
+alloc_status
+mem_sample_close();
+
+alloc_status
+mem_sample_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif //DENVER_OS_PA_C_MEM_POOL_H
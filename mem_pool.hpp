@@ -0,0 +1,332 @@
+/*
+ * Header-only C++ wrapper over the memory pool (see mem_pool.h).
+ *
+ * pool<Policy, Alignment, Classes> fixes the policy, the alignment of the
+ * allocations and a table of size classes at compile time. Requests are
+ * rounded in the inlined wrapper with constant masks and tables, and the
+ * pool is opened with the one engine it will ever use, so no call decides
+ * anything about the policy at run time.
+ *
+ * Allocations come back as move-only handles that free on destruction, and
+ * object<T> constructs a T in pool memory the same way, so nothing has to
+ * go on the heap just to have its lifetime managed. Handles have to go
+ * before their pool, and pools before mem_free(). Needs C++17.
+ *
+ *     mem::pool<mem::best_fit, 16, mem::size_classes<32, 64, 128>> pool(1 << 20);
+ *     mem::handle buffer = pool.allocate(100);      // 128 bytes, freed at scope exit
+ *     mem::object<point> p = pool.make<point>(1, 2);
+ *
+ * resource adapts a pool to std::pmr::memory_resource, for the standard
+ * containers. Per-request containers can live in a pool of their own and
+ * go with it in one mem_pool_destroy(), without their destructors running.
+ *
+ *     mem::pool<> pool(1 << 20);
+ *     mem::resource resource(pool);
+ *     std::pmr::vector<std::pmr::string> names(&resource);
+ */
+
+#ifndef DENVER_OS_PA_C_MEM_POOL_HPP
+#define DENVER_OS_PA_C_MEM_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "mem_pool.h"
+
+namespace mem {
+
+/* policies */
+
+struct first_fit {
+    static constexpr alloc_policy value = FIRST_FIT;
+    static constexpr std::size_t max_alignment = alignof(std::max_align_t); // of the pool memory
+};
+
+struct best_fit {
+    static constexpr alloc_policy value = BEST_FIT;
+    static constexpr std::size_t max_alignment = alignof(std::max_align_t);
+};
+
+struct bitmap {
+    static constexpr alloc_policy value = BITMAP;
+    static constexpr std::size_t max_alignment = 64; // the memory starts on a chunk (MEM_BITMAP_CHUNK_SIZE)
+};
+
+
+/* size classes: a request is rounded up to the first class that holds it, larger ones stay as they are */
+
+template <std::size_t... Sizes>
+struct size_classes {
+    static constexpr std::size_t count = sizeof...(Sizes);
+    static constexpr std::size_t sizes[count + 1] = {Sizes..., 0};
+
+    static constexpr std::size_t round(std::size_t size) noexcept {
+        for (std::size_t c = 0; c < count; ++c) {
+            if (size <= sizes[c]) {
+                return sizes[c];
+            }
+        }
+        return size;
+    }
+
+    static constexpr bool ascending() noexcept {
+        for (std::size_t c = 1; c < count; ++c) {
+            if (sizes[c] <= sizes[c - 1]) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+/* an allocation, freed when the handle goes */
+
+class handle {
+public:
+    handle() noexcept = default;
+    handle(pool_pt pool, alloc_pt alloc) noexcept : pool_(pool), alloc_(alloc) {}
+
+    handle(handle &&other) noexcept
+            : pool_(other.pool_), alloc_(std::exchange(other.alloc_, nullptr)) {}
+
+    handle &operator=(handle &&other) noexcept {
+        if (this != &other) {
+            reset();
+            pool_ = other.pool_;
+            alloc_ = std::exchange(other.alloc_, nullptr);
+        }
+        return *this;
+    }
+
+    handle(const handle &) = delete;
+    handle &operator=(const handle &) = delete;
+
+    ~handle() { reset(); }
+
+    void *get() const noexcept { return (alloc_ != nullptr) ? alloc_->mem : nullptr; }
+    std::size_t size() const noexcept { return (alloc_ != nullptr) ? alloc_->size : 0; }
+    pool_pt pool() const noexcept { return pool_; }
+    explicit operator bool() const noexcept { return alloc_ != nullptr; }
+
+    // gives up ownership, the caller frees with mem_del_alloc
+    alloc_pt release() noexcept { return std::exchange(alloc_, nullptr); }
+
+    void reset() noexcept {
+        if (alloc_ != nullptr) {
+            mem_del_alloc(pool_, alloc_);
+            alloc_ = nullptr;
+        }
+    }
+
+private:
+    pool_pt pool_ = nullptr;
+    alloc_pt alloc_ = nullptr;
+};
+
+
+/* a T in pool memory, destroyed and freed when the object goes */
+
+template <typename T>
+class object {
+public:
+    object() noexcept = default;
+    explicit object(handle &&memory) noexcept : memory_(std::move(memory)) {} // holds a constructed T
+
+    object(object &&other) noexcept = default;
+
+    object &operator=(object &&other) noexcept {
+        if (this != &other) {
+            reset();
+            memory_ = std::move(other.memory_);
+        }
+        return *this;
+    }
+
+    object(const object &) = delete;
+    object &operator=(const object &) = delete;
+
+    ~object() { reset(); }
+
+    T *get() const noexcept { return static_cast<T *>(memory_.get()); }
+    T &operator*() const noexcept { return *get(); }
+    T *operator->() const noexcept { return get(); }
+    explicit operator bool() const noexcept { return static_cast<bool>(memory_); }
+
+    void reset() noexcept {
+        if (memory_) {
+            get()->~T();
+            memory_.reset();
+        }
+    }
+
+private:
+    handle memory_;
+};
+
+
+/* a pool, closed when it goes */
+
+template <typename Policy = first_fit,
+          std::size_t Alignment = Policy::max_alignment,
+          typename Classes = size_classes<>>
+class pool {
+    static_assert(Alignment > 0 && (Alignment & (Alignment - 1)) == 0, "the alignment has to be a power of two");
+    static_assert(Alignment <= Policy::max_alignment, "the pool memory is not aligned that far");
+    static_assert(Classes::ascending(), "the size classes have to be in ascending order");
+
+public:
+    using policy_type = Policy;
+    static constexpr std::size_t alignment = Alignment;
+
+    // throws std::bad_alloc if the pool can't be opened
+    explicit pool(std::size_t size) : pool_(open(size)) {}
+
+    pool(pool &&other) noexcept : pool_(std::exchange(other.pool_, nullptr)) {}
+
+    pool &operator=(pool &&other) noexcept {
+        if (this != &other) {
+            close();
+            pool_ = std::exchange(other.pool_, nullptr);
+        }
+        return *this;
+    }
+
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    ~pool() { close(); }
+
+    // the size a request is served with: its class, then a multiple of the alignment,
+    // so every allocation starts aligned
+    static constexpr std::size_t round(std::size_t size) noexcept {
+        size = Classes::round(size);
+        if (size > static_cast<std::size_t>(-1) - (Alignment - 1)) {
+            return size; // too large for any pool anyway
+        }
+        return (size + Alignment - 1) & ~(Alignment - 1);
+    }
+
+    alloc_pt raw_alloc(std::size_t size) noexcept { return mem_new_alloc(pool_, round(size)); }
+    alloc_status raw_free(alloc_pt alloc) noexcept { return mem_del_alloc(pool_, alloc); }
+
+    // an empty handle if the pool is out of memory
+    handle allocate(std::size_t size) noexcept { return handle(pool_, raw_alloc(size)); }
+
+    // an empty object if the pool is out of memory; if the constructor throws, the memory is freed
+    template <typename T, typename... Args>
+    object<T> make(Args &&... args) {
+        static_assert(alignof(T) <= Alignment, "T needs a stronger alignment than the pool's");
+        handle memory = allocate(sizeof(T));
+        if (!memory) {
+            return object<T>();
+        }
+        ::new (memory.get()) T(std::forward<Args>(args)...);
+        return object<T>(std::move(memory));
+    }
+
+    alloc_status stats(pool_stats_t &stats) const noexcept { return mem_pool_stats(pool_, &stats); }
+    alloc_status defer_coalescing(unsigned max_deferred) noexcept {
+        return mem_pool_defer_coalescing(pool_, max_deferred);
+    }
+
+    // closes the pool with whatever is still in it; its handles and objects
+    // must not be used (or reset) afterwards
+    void destroy() noexcept {
+        if (pool_ != nullptr) {
+            mem_pool_destroy(pool_);
+            pool_ = nullptr;
+        }
+    }
+
+    pool_pt get() const noexcept { return pool_; }
+
+private:
+    static pool_pt open(std::size_t size) {
+        // the first pool sets up the pool store, later ones find it there
+        mem_init();
+        pool_pt opened = mem_pool_open(size, Policy::value);
+        if (opened == nullptr) {
+            throw std::bad_alloc();
+        }
+        return opened;
+    }
+
+    void close() noexcept {
+        // fails, and leaves the pool to mem_free(), if handles are still out
+        if (pool_ != nullptr) {
+            mem_pool_close(pool_);
+            pool_ = nullptr;
+        }
+    }
+
+    pool_pt pool_;
+};
+
+
+
+/* a std::pmr::memory_resource over a pool */
+
+class resource : public std::pmr::memory_resource {
+public:
+    // base_alignment is what every allocation of the pool starts at a multiple of
+    explicit resource(pool_pt pool, std::size_t base_alignment = 1) noexcept
+            : pool_(pool), base_alignment_(base_alignment), round_(nullptr) {}
+
+    // requests go through the pool's rounding, so its allocations stay aligned
+    template <typename Policy, std::size_t Alignment, typename Classes>
+    explicit resource(pool<Policy, Alignment, Classes> &owner) noexcept
+            : pool_(owner.get()), base_alignment_(Alignment), round_(&pool<Policy, Alignment, Classes>::round) {}
+
+    pool_pt get() const noexcept { return pool_; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        // the handle goes right in front of the memory, so deallocation finds it in O(1);
+        // the slack covers aligning past what the pool guarantees
+        std::size_t header = (sizeof(alloc_pt) + alignment - 1) & ~(alignment - 1);
+        std::size_t slack = (alignment > base_alignment_) ? alignment - base_alignment_ : 0;
+        if (bytes > static_cast<std::size_t>(-1) - header - slack) {
+            throw std::bad_alloc();
+        }
+        std::size_t size = bytes + header + slack;
+
+        alloc_pt alloc = mem_new_alloc(pool_, (round_ != nullptr) ? round_(size) : size);
+        if (alloc == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        std::uintptr_t start = reinterpret_cast<std::uintptr_t>(alloc->mem) + sizeof(alloc_pt);
+        char *mem = reinterpret_cast<char *>((start + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1));
+        std::memcpy(mem - sizeof(alloc_pt), &alloc, sizeof(alloc_pt));
+        return mem;
+    }
+
+    void do_deallocate(void *mem, std::size_t bytes, std::size_t alignment) override {
+        alloc_pt alloc;
+        (void) bytes;
+        (void) alignment;
+
+        std::memcpy(&alloc, static_cast<char *>(mem) - sizeof(alloc_pt), sizeof(alloc_pt));
+        mem_del_alloc(pool_, alloc);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        // interchangeable with any resource over the same pool
+        const resource *other_resource = dynamic_cast<const resource *>(&other);
+        return other_resource != nullptr && other_resource->pool_ == pool_;
+    }
+
+private:
+    pool_pt pool_;
+    std::size_t base_alignment_;
+    std::size_t (*round_)(std::size_t);
+};
+
+} // namespace mem
+
+#endif //DENVER_OS_PA_C_MEM_POOL_HPP
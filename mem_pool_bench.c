@@ -0,0 +1,537 @@
+/*
+ * Standalone benchmark for the memory pool.
+ *
+ * Runs synthetic workloads against FIRST_FIT (also with deferred coalescing),
+ * BEST_FIT and BITMAP pools, a size-class group of pools, and the C library
+ * malloc() as a baseline. Every allocator sees the same pre-generated
+ * sequence of operations.
+ *
+ * usage: mem_pool_bench [workload] [num_ops] [live_set] [seed]
+ *
+ *   workload: uniform | powerlaw | churn | prodcons | ramp | all (default)
+ *   live_set: 2 and up
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "mem_pool.h"
+
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned   BENCH_DEFAULT_NUM_OPS           = 200000;
+static const unsigned   BENCH_DEFAULT_LIVE_SET          = 1000;
+static const unsigned   BENCH_MIN_LIVE_SET              = 2;
+static const unsigned   BENCH_DEFAULT_SEED              = 42;
+#define                 BENCH_POOL_SIZE                   (64 * 1024 * 1024) // bytes, a macro so the group classes can use it
+static const unsigned   BENCH_STATS_INTERVAL            = 64; // ops between stats samples
+static const unsigned   BENCH_MAX_DEFERRED              = 256; // for the deferred-coalescing run
+
+static const size_t     BENCH_MIN_SIZE                  = 16;
+static const size_t     BENCH_MAX_SIZE                  = 4096;
+static const size_t     BENCH_CHURN_SIZE                = 64;
+static const double     BENCH_POWERLAW_ALPHA            = 1.2;
+
+// the group: slab-like small members, then BEST_FIT medium and FIRST_FIT large
+static const pool_group_class_t BENCH_GROUP_CLASSES[] = {
+        {64,          BENCH_POOL_SIZE / 8, BITMAP},
+        {128,         BENCH_POOL_SIZE / 8, BITMAP},
+        {256,         BENCH_POOL_SIZE / 8, BITMAP},
+        {4096,        BENCH_POOL_SIZE / 2, BEST_FIT},
+        {(size_t) -1, BENCH_POOL_SIZE / 4, FIRST_FIT}
+};
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef enum _op_kind { OP_ALLOC, OP_FREE } op_kind;
+
+typedef struct _op {
+    op_kind kind;
+    unsigned slot;  // index into the table of live handles
+    size_t size;
+} op_t, *op_pt;
+
+typedef struct _workload {
+    const char *name;
+    unsigned (*generate)(op_pt ops, unsigned num_ops, unsigned live_set);
+} workload_t;
+
+typedef struct _result {
+    double ops_per_sec;
+    unsigned long long p50, p99, p999; // ns per op
+    unsigned long failed;
+    size_t peak_metadata_size;
+    double mean_fragmentation;
+} result_t;
+
+
+
+/***************************/
+/*                         */
+/* Static global variables */
+/*                         */
+/***************************/
+static unsigned long long rng_state = 0;
+
+
+
+/*************************/
+/*                       */
+/* Random number helpers */
+/*                       */
+/*************************/
+static unsigned long long _rng_next()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double _rng_unit()
+{
+    return (_rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t _rng_uniform_size()
+{
+    return BENCH_MIN_SIZE + _rng_next() % (BENCH_MAX_SIZE - BENCH_MIN_SIZE + 1);
+}
+
+static size_t _rng_powerlaw_size()
+{
+    // Pareto: most requests are small, a few are very large
+    double size = BENCH_MIN_SIZE * pow(1.0 - _rng_unit(), -1.0 / BENCH_POWERLAW_ALPHA);
+    return (size > BENCH_MAX_SIZE * 16) ? BENCH_MAX_SIZE * 16 : (size_t) size;
+}
+
+
+
+/***********************/
+/*                     */
+/* Workload generators */
+/*                     */
+/***********************/
+/*
+ * The generators keep a table of live slots and emit alloc/free
+ * operations against it. They return the number of slots used.
+ */
+static unsigned _gen_random(op_pt ops, unsigned num_ops, unsigned live_set,
+                            size_t (*next_size)())
+{
+    // slots[0, num_live) are live, the rest are free
+    unsigned *slots = calloc(live_set, sizeof(unsigned));
+    unsigned num_live = 0;
+
+    for (unsigned s = 0; s < live_set; ++s) {
+        slots[s] = s;
+    }
+
+    // allocate up to half the live set, then free and allocate at random;
+    // with nothing live, there is nothing to free
+    for (unsigned u = 0; u < num_ops; ++u) {
+        if (num_live == 0 || (num_live < live_set && (num_live < live_set / 2 || (_rng_next() & 1)))) {
+            ops[u].kind = OP_ALLOC;
+            ops[u].slot = slots[num_live];
+            ops[u].size = next_size();
+            ++num_live;
+        }
+        else {
+            // swap a random live slot to the end of the live range and free it
+            unsigned victim = (unsigned) (_rng_next() % num_live);
+            --num_live;
+            unsigned tmp = slots[victim];
+            slots[victim] = slots[num_live];
+            slots[num_live] = tmp;
+            ops[u].kind = OP_FREE;
+            ops[u].slot = tmp;
+            ops[u].size = 0;
+        }
+    }
+
+    free(slots);
+    return live_set;
+}
+
+static unsigned _gen_uniform(op_pt ops, unsigned num_ops, unsigned live_set)
+{
+    return _gen_random(ops, num_ops, live_set, _rng_uniform_size);
+}
+
+static unsigned _gen_powerlaw(op_pt ops, unsigned num_ops, unsigned live_set)
+{
+    return _gen_random(ops, num_ops, live_set, _rng_powerlaw_size);
+}
+
+static size_t _churn_size()
+{
+    return BENCH_CHURN_SIZE;
+}
+
+static unsigned _gen_churn(op_pt ops, unsigned num_ops, unsigned live_set)
+{
+    return _gen_random(ops, num_ops, live_set, _churn_size);
+}
+
+static unsigned _gen_prodcons(op_pt ops, unsigned num_ops, unsigned live_set)
+{
+    // a FIFO queue: the producer allocates at the tail, the consumer frees
+    // at the head, so every block lives for about live_set operations
+    unsigned head = 0, tail = 0;
+
+    for (unsigned u = 0; u < num_ops; ++u) {
+        if (tail - head < live_set && (tail - head < live_set / 2 || (_rng_next() & 1))) {
+            ops[u].kind = OP_ALLOC;
+            ops[u].slot = tail % live_set;
+            ops[u].size = _rng_uniform_size();
+            ++tail;
+        }
+        else {
+            ops[u].kind = OP_FREE;
+            ops[u].slot = head % live_set;
+            ops[u].size = 0;
+            ++head;
+        }
+    }
+
+    return live_set;
+}
+
+static unsigned _gen_ramp(op_pt ops, unsigned num_ops, unsigned live_set)
+{
+    // allocate everything, then drain in random order, and repeat
+    unsigned *order = calloc(live_set, sizeof(unsigned));
+    unsigned u = 0;
+
+    while (u < num_ops) {
+        for (unsigned s = 0; s < live_set && u < num_ops; ++s, ++u) {
+            ops[u].kind = OP_ALLOC;
+            ops[u].slot = s;
+            ops[u].size = _rng_uniform_size();
+            order[s] = s;
+        }
+        for (unsigned s = live_set; s > 1; --s) {
+            unsigned other = (unsigned) (_rng_next() % s);
+            unsigned tmp = order[s - 1];
+            order[s - 1] = order[other];
+            order[other] = tmp;
+        }
+        for (unsigned s = 0; s < live_set && u < num_ops; ++s, ++u) {
+            ops[u].kind = OP_FREE;
+            ops[u].slot = order[s];
+            ops[u].size = 0;
+        }
+    }
+
+    free(order);
+    return live_set;
+}
+
+static const workload_t workloads[] = {
+        {"uniform",  _gen_uniform},
+        {"powerlaw", _gen_powerlaw},
+        {"churn",    _gen_churn},
+        {"prodcons", _gen_prodcons},
+        {"ramp",     _gen_ramp},
+};
+
+
+
+/******************/
+/*                */
+/* Timing helpers */
+/*                */
+/******************/
+static unsigned long long _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int _cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+static void _percentiles(unsigned long long *lat, unsigned num_ops, result_t *result)
+{
+    qsort(lat, num_ops, sizeof(unsigned long long), _cmp_ull);
+    result->p50 = lat[(unsigned) (num_ops * 0.5)];
+    result->p99 = lat[(unsigned) (num_ops * 0.99)];
+    result->p999 = lat[(unsigned) (num_ops * 0.999)];
+}
+
+
+
+/***********/
+/*         */
+/* Runners */
+/*         */
+/***********/
+static void _run_pool(alloc_policy policy, unsigned max_deferred, const op_t *ops, unsigned num_ops,
+                      unsigned num_slots, unsigned long long *lat, result_t *result)
+{
+    alloc_pt *slots = calloc(num_slots, sizeof(alloc_pt));
+    pool_stats_t stats;
+    double fragmentation = 0.0;
+    unsigned samples = 0;
+    unsigned long long stats_ns = 0;
+
+    memset(result, 0, sizeof(result_t));
+
+    mem_init();
+    pool_pt pool = mem_pool_open(BENCH_POOL_SIZE, policy);
+    if (pool == NULL) {
+        fprintf(stderr, "mem_pool_open failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (max_deferred > 0) {
+        mem_pool_defer_coalescing(pool, max_deferred);
+    }
+
+    unsigned long long start = _now_ns();
+    for (unsigned u = 0; u < num_ops; ++u) {
+        unsigned long long t0 = _now_ns();
+        if (ops[u].kind == OP_ALLOC) {
+            slots[ops[u].slot] = mem_new_alloc(pool, ops[u].size);
+            if (slots[ops[u].slot] == NULL) {
+                ++(result->failed);
+            }
+        }
+        else if (slots[ops[u].slot] != NULL) {
+            mem_del_alloc(pool, slots[ops[u].slot]);
+            slots[ops[u].slot] = NULL;
+        }
+        lat[u] = _now_ns() - t0;
+
+        // the gap tree keeps both gap extremes at its root, for FIRST_FIT and
+        // BEST_FIT alike, but a bitmap pool walks its bitmap, so sample (untimed)
+        if (u % BENCH_STATS_INTERVAL == 0) {
+            unsigned long long t1 = _now_ns();
+            mem_pool_stats(pool, &stats);
+            if (stats.metadata_size > result->peak_metadata_size) {
+                result->peak_metadata_size = stats.metadata_size;
+            }
+            fragmentation += stats.fragmentation;
+            ++samples;
+            stats_ns += _now_ns() - t1;
+        }
+    }
+    result->ops_per_sec = num_ops / ((_now_ns() - start - stats_ns) / 1e9);
+    result->mean_fragmentation = fragmentation / samples;
+
+    // clean up
+    for (unsigned s = 0; s < num_slots; ++s) {
+        if (slots[s] != NULL) {
+            mem_del_alloc(pool, slots[s]);
+        }
+    }
+    if (mem_pool_close(pool) != ALLOC_OK) {
+        fprintf(stderr, "pool not empty after the run\n");
+        exit(EXIT_FAILURE);
+    }
+    mem_free();
+    free(slots);
+
+    _percentiles(lat, num_ops, result);
+}
+
+static void _run_group(const op_t *ops, unsigned num_ops,
+                       unsigned num_slots, unsigned long long *lat, result_t *result)
+{
+    alloc_pt *slots = calloc(num_slots, sizeof(alloc_pt));
+    unsigned num_classes = sizeof(BENCH_GROUP_CLASSES) / sizeof(BENCH_GROUP_CLASSES[0]);
+    pool_stats_t stats;
+    double fragmentation = 0.0;
+    unsigned samples = 0;
+    unsigned long long stats_ns = 0;
+
+    memset(result, 0, sizeof(result_t));
+
+    mem_init();
+    pool_group_pt group = mem_group_open(BENCH_GROUP_CLASSES, num_classes);
+    if (group == NULL) {
+        fprintf(stderr, "mem_group_open failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long start = _now_ns();
+    for (unsigned u = 0; u < num_ops; ++u) {
+        unsigned long long t0 = _now_ns();
+        if (ops[u].kind == OP_ALLOC) {
+            slots[ops[u].slot] = mem_group_alloc(group, ops[u].size);
+            if (slots[ops[u].slot] == NULL) {
+                ++(result->failed);
+            }
+        }
+        else if (slots[ops[u].slot] != NULL) {
+            mem_group_del_alloc(group, slots[ops[u].slot]);
+            slots[ops[u].slot] = NULL;
+        }
+        lat[u] = _now_ns() - t0;
+
+        // metadata adds up over the members, fragmentation is weighted by free size
+        if (u % BENCH_STATS_INTERVAL == 0) {
+            unsigned long long t1 = _now_ns();
+            size_t metadata_size = 0, free_size = 0;
+            double weighted = 0.0;
+            for (unsigned m = 0; m < group->num_pools; ++m) {
+                mem_pool_stats(group->pools[m], &stats);
+                metadata_size += stats.metadata_size;
+                free_size += stats.free_size;
+                weighted += stats.fragmentation * stats.free_size;
+            }
+            if (metadata_size > result->peak_metadata_size) {
+                result->peak_metadata_size = metadata_size;
+            }
+            fragmentation += (free_size > 0) ? weighted / free_size : 0.0;
+            ++samples;
+            stats_ns += _now_ns() - t1;
+        }
+    }
+    result->ops_per_sec = num_ops / ((_now_ns() - start - stats_ns) / 1e9);
+    result->mean_fragmentation = fragmentation / samples;
+
+    // clean up
+    for (unsigned s = 0; s < num_slots; ++s) {
+        if (slots[s] != NULL) {
+            mem_group_del_alloc(group, slots[s]);
+        }
+    }
+    if (mem_group_close(group) != ALLOC_OK) {
+        fprintf(stderr, "group not empty after the run\n");
+        exit(EXIT_FAILURE);
+    }
+    mem_free();
+    free(slots);
+
+    _percentiles(lat, num_ops, result);
+}
+
+static void _run_malloc(const op_t *ops, unsigned num_ops,
+                        unsigned num_slots, unsigned long long *lat, result_t *result)
+{
+    void **slots = calloc(num_slots, sizeof(void *));
+
+    memset(result, 0, sizeof(result_t));
+
+    unsigned long long start = _now_ns();
+    for (unsigned u = 0; u < num_ops; ++u) {
+        unsigned long long t0 = _now_ns();
+        if (ops[u].kind == OP_ALLOC) {
+            slots[ops[u].slot] = malloc(ops[u].size);
+            if (slots[ops[u].slot] == NULL) {
+                ++(result->failed);
+            }
+        }
+        else {
+            free(slots[ops[u].slot]);
+            slots[ops[u].slot] = NULL;
+        }
+        lat[u] = _now_ns() - t0;
+    }
+    result->ops_per_sec = num_ops / ((_now_ns() - start) / 1e9);
+
+    // clean up
+    for (unsigned s = 0; s < num_slots; ++s) {
+        free(slots[s]);
+    }
+    free(slots);
+
+    _percentiles(lat, num_ops, result);
+}
+
+static void _print_result(const char *workload, const char *allocator, const result_t *result)
+{
+    printf("%-10s %-12s %12.0f %8llu %8llu %8llu %8lu %12lu %8.4f\n",
+           workload, allocator, result->ops_per_sec,
+           result->p50, result->p99, result->p999,
+           result->failed, (unsigned long) result->peak_metadata_size,
+           result->mean_fragmentation);
+}
+
+
+
+/********/
+/*      */
+/* main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    const char *which = (argc > 1) ? argv[1] : "all";
+    unsigned num_ops = (argc > 2) ? (unsigned) strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_NUM_OPS;
+    unsigned live_set = (argc > 3) ? (unsigned) strtoul(argv[3], NULL, 10) : BENCH_DEFAULT_LIVE_SET;
+    unsigned seed = (argc > 4) ? (unsigned) strtoul(argv[4], NULL, 10) : BENCH_DEFAULT_SEED;
+    unsigned num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+    unsigned ran = 0;
+
+    // a live set of one would only ever alternate one allocation and its free
+    if (num_ops == 0 || live_set < BENCH_MIN_LIVE_SET) {
+        fprintf(stderr, "usage: %s [uniform|powerlaw|churn|prodcons|ramp|all] [num_ops] [live_set] [seed]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    op_pt ops = calloc(num_ops, sizeof(op_t));
+    unsigned long long *lat = calloc(num_ops, sizeof(unsigned long long));
+    result_t result;
+
+    printf("%-10s %-12s %12s %8s %8s %8s %8s %12s %8s\n",
+           "workload", "allocator", "ops/sec", "p50 ns", "p99 ns", "p999 ns",
+           "failed", "peak meta B", "frag");
+
+    for (unsigned w = 0; w < num_workloads; ++w) {
+        if (strcmp(which, "all") != 0 && strcmp(which, workloads[w].name) != 0) {
+            continue;
+        }
+        ++ran;
+
+        rng_state = seed * 0x9E3779B97F4A7C15ull + w + 1;
+        unsigned num_slots = workloads[w].generate(ops, num_ops, live_set);
+
+        _run_pool(FIRST_FIT, 0, ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "FIRST_FIT", &result);
+
+        _run_pool(FIRST_FIT, BENCH_MAX_DEFERRED, ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "FIRST_FIT+d", &result);
+
+        _run_pool(BEST_FIT, 0, ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "BEST_FIT", &result);
+
+        _run_pool(BITMAP, 0, ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "BITMAP", &result);
+
+        _run_group(ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "group", &result);
+
+        _run_malloc(ops, num_ops, num_slots, lat, &result);
+        _print_result(workloads[w].name, "malloc", &result);
+    }
+
+    free(ops);
+    free(lat);
+
+    if (ran == 0) {
+        fprintf(stderr, "unknown workload: %s\n", which);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,426 @@
+/*
+ * malloc() replacement backed by the memory pool, for LD_PRELOAD.
+ *
+ *     LD_PRELOAD=./libmem_pool_malloc.so MEM_POOL_POLICY=best_fit ./app
+ *
+ * malloc, free, calloc, realloc, posix_memalign, aligned_alloc, memalign
+ * and malloc_usable_size are served from pools opened with mem_pool_open(),
+ * a new one (twice the size of the last) whenever none has room. Requests
+ * of the mmap threshold and up bypass the pools and go straight to mmap().
+ *
+ * The pools are not thread-safe, so one lock covers all of them. While a
+ * thread holds it, whatever the pools allocate for themselves (pool store,
+ * node heap) comes from glibc, so a pool never allocates from
+ * itself. Pointers that are neither in a pool nor mapped here, which glibc
+ * handed out that way, are given back to glibc.
+ *
+ *   MEM_POOL_POLICY          first_fit (default) | best_fit | bitmap
+ *   MEM_POOL_MMAP_THRESHOLD  in bytes, 128 KiB by default
+ */
+
+#define _GNU_SOURCE // for RTLD_NEXT
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mem_pool.h"
+
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const size_t     SHIM_INIT_POOL_SIZE             = 64 << 20; // mapped, so committed as touched
+static const size_t     SHIM_MAX_POOL_SIZE              = (size_t) 1 << 32;
+#define                 SHIM_MAX_POOLS                    64
+static const size_t     SHIM_DEFAULT_MMAP_THRESHOLD     = 128 << 10;
+#define                 SHIM_ALIGNMENT                    16 // of every pointer handed out, as glibc's
+static const uintptr_t  SHIM_MAP_MAGIC                  = 0x6d656d5f706f6f6cull;
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef struct _pool_header {
+    alloc_pt alloc;      // the memory was carved out of
+    size_t reserved;     // keeps the memory aligned
+} pool_header_t;
+
+typedef struct _map_header {
+    size_t length;       // of the mapping
+    size_t offset;       // of the memory into the mapping
+    uintptr_t check;     // SHIM_MAP_MAGIC ^ the address of the memory, read first
+} map_header_t;
+
+typedef enum _shim_kind { SHIM_POOL, SHIM_MAP, SHIM_LIBC } shim_kind;
+
+
+
+/***************************/
+/*                         */
+/* Static global variables */
+/*                         */
+/***************************/
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int shim_in_pool __attribute__((tls_model("initial-exec"))); // holds the lock
+static int shim_ready = 0;
+static pool_pt shim_pools[SHIM_MAX_POOLS];
+static unsigned shim_num_pools = 0;
+static unsigned shim_current = 0; // served the last allocation
+static alloc_policy shim_policy = FIRST_FIT;
+static size_t shim_mmap_threshold = 0;
+static size_t shim_page_size = 0;
+static size_t (*shim_libc_usable_size)(void *) = NULL;
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *mem);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *mem, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+
+
+/*******************/
+/*                 */
+/* Static routines */
+/*                 */
+/*******************/
+static void _shim_enter()
+{
+    pthread_mutex_lock(&shim_lock);
+    shim_in_pool = 1;
+}
+
+static void _shim_leave()
+{
+    shim_in_pool = 0;
+    pthread_mutex_unlock(&shim_lock);
+}
+
+static void _shim_fork_prepare() { pthread_mutex_lock(&shim_lock); }
+static void _shim_fork_release() { pthread_mutex_unlock(&shim_lock); }
+
+static void _shim_init()
+{
+    // under the lock, so glibc serves whatever this allocates
+    if (__atomic_load_n(&shim_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    const char *policy = getenv("MEM_POOL_POLICY");
+    const char *threshold = getenv("MEM_POOL_MMAP_THRESHOLD");
+
+    if (policy != NULL && strcmp(policy, "best_fit") == 0) {
+        shim_policy = BEST_FIT;
+    }
+    else if (policy != NULL && strcmp(policy, "bitmap") == 0) {
+        shim_policy = BITMAP;
+    }
+    shim_mmap_threshold = (threshold != NULL) ? strtoul(threshold, NULL, 10) : SHIM_DEFAULT_MMAP_THRESHOLD;
+    shim_page_size = (size_t) sysconf(_SC_PAGESIZE);
+    shim_libc_usable_size = (size_t (*)(void *)) dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    mem_init();
+
+    // a child forked while another thread held the lock would never get it
+    pthread_atfork(_shim_fork_prepare, _shim_fork_release, _shim_fork_release);
+
+    __atomic_store_n(&shim_ready, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned _shim_pool_of(const void *mem)
+{
+    // under the lock
+    for (unsigned p = 0; p < shim_num_pools; ++p) {
+        if ((const char *) mem >= shim_pools[p]->mem
+            && (const char *) mem < shim_pools[p]->mem + shim_pools[p]->total_size) {
+            return p;
+        }
+    }
+    return SHIM_MAX_POOLS;
+}
+
+static pool_pt _shim_open_pool(size_t request)
+{
+    // under the lock: each pool twice the size of the last
+    size_t size = SHIM_INIT_POOL_SIZE;
+    for (unsigned p = 0; p < shim_num_pools && size < SHIM_MAX_POOL_SIZE; ++p) {
+        size *= 2;
+    }
+    while (size < request * 2) {
+        size *= 2;
+    }
+    if (shim_num_pools == SHIM_MAX_POOLS) {
+        return NULL;
+    }
+
+    pool_pt pool = mem_pool_open(size, shim_policy);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    // node heap pools hand out sizes (so offsets) of whole alignment units
+    if (shim_policy != BITMAP) {
+        mem_pool_tune(pool, SHIM_ALIGNMENT, 0);
+    }
+    shim_pools[shim_num_pools++] = pool;
+    return pool;
+}
+
+static void *_shim_pool_alloc(size_t size, size_t alignment)
+{
+    // under the lock: room for the header, and to align past what the pool does
+    size_t request = size + sizeof(pool_header_t) + alignment - SHIM_ALIGNMENT;
+    alloc_pt alloc = NULL;
+
+    // the pool that served the last one, then the others, then a new one
+    if (shim_num_pools > 0) {
+        alloc = mem_new_alloc(shim_pools[shim_current], request);
+    }
+    for (unsigned p = 0; alloc == NULL && p < shim_num_pools; ++p) {
+        if (p != shim_current && (alloc = mem_new_alloc(shim_pools[p], request)) != NULL) {
+            shim_current = p;
+        }
+    }
+    if (alloc == NULL) {
+        pool_pt pool = _shim_open_pool(request);
+        if (pool == NULL || (alloc = mem_new_alloc(pool, request)) == NULL) {
+            return NULL;
+        }
+        shim_current = shim_num_pools - 1;
+    }
+
+    uintptr_t start = (uintptr_t) alloc->mem + sizeof(pool_header_t);
+    char *mem = (char *) ((start + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    ((pool_header_t *) mem - 1)->alloc = alloc;
+    return mem;
+}
+
+static void *_shim_map_alloc(size_t size, size_t alignment)
+{
+    // the header ends right at the memory, which is aligned past it
+    if (size > (size_t) -1 - sizeof(map_header_t) - alignment - shim_page_size) {
+        return NULL;
+    }
+    size_t length = (size + sizeof(map_header_t) + alignment - 1 + shim_page_size - 1) & ~(shim_page_size - 1);
+
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t) base + sizeof(map_header_t);
+    char *mem = (char *) ((start + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    map_header_t *header = (map_header_t *) mem - 1;
+    header->length = length;
+    header->offset = mem - base;
+    header->check = SHIM_MAP_MAGIC ^ (uintptr_t) mem;
+    return mem;
+}
+
+static void *_shim_alloc(size_t size, size_t alignment)
+{
+    void *mem;
+
+    if (!__atomic_load_n(&shim_ready, __ATOMIC_ACQUIRE)) {
+        _shim_enter();
+        _shim_init();
+        _shim_leave();
+    }
+
+    if (size >= shim_mmap_threshold || size > (size_t) -1 / 2 - alignment) {
+        mem = _shim_map_alloc(size, alignment);
+    }
+    else {
+        _shim_enter();
+        mem = _shim_pool_alloc(size, alignment);
+        _shim_leave();
+    }
+
+    if (mem == NULL) {
+        errno = ENOMEM;
+    }
+    return mem;
+}
+
+static shim_kind _shim_kind_of(void *mem, size_t *usable)
+{
+    // a pool's, by address
+    _shim_enter();
+    unsigned p = _shim_pool_of(mem);
+    if (p < shim_num_pools) {
+        alloc_pt alloc = ((pool_header_t *) mem - 1)->alloc;
+        *usable = alloc->mem + alloc->size - (char *) mem;
+    }
+    _shim_leave();
+    if (p < SHIM_MAX_POOLS) {
+        return SHIM_POOL;
+    }
+
+    // a mapping's, by the check word (glibc's chunk header is readable there too)
+    map_header_t *header = (map_header_t *) mem - 1;
+    if (header->check == (SHIM_MAP_MAGIC ^ (uintptr_t) mem)) {
+        *usable = header->length - header->offset;
+        return SHIM_MAP;
+    }
+
+    *usable = (shim_libc_usable_size != NULL) ? shim_libc_usable_size(mem) : 0;
+    return SHIM_LIBC;
+}
+
+
+
+/**********************/
+/*                    */
+/* Interposed symbols */
+/*                    */
+/**********************/
+SHIM_EXPORT void *malloc(size_t size)
+{
+    if (shim_in_pool) {
+        return __libc_malloc(size);
+    }
+    return _shim_alloc(size, SHIM_ALIGNMENT);
+}
+
+SHIM_EXPORT void free(void *mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+    if (shim_in_pool) {
+        __libc_free(mem);
+        return;
+    }
+
+    // a pool's
+    _shim_enter();
+    unsigned p = _shim_pool_of(mem);
+    if (p < shim_num_pools) {
+        mem_del_alloc(shim_pools[p], ((pool_header_t *) mem - 1)->alloc);
+    }
+    _shim_leave();
+    if (p < SHIM_MAX_POOLS) {
+        return;
+    }
+
+    // a mapping's
+    map_header_t *header = (map_header_t *) mem - 1;
+    if (header->check == (SHIM_MAP_MAGIC ^ (uintptr_t) mem)) {
+        header->check = 0;
+        munmap((char *) mem - header->offset, header->length);
+        return;
+    }
+
+    __libc_free(mem);
+}
+
+SHIM_EXPORT void *calloc(size_t num, size_t size)
+{
+    if (shim_in_pool) {
+        return __libc_calloc(num, size);
+    }
+    if (size != 0 && num > (size_t) -1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // fresh mappings are zeroed already, reused pool memory isn't
+    void *mem = _shim_alloc(num * size, SHIM_ALIGNMENT);
+    if (mem != NULL && num * size < shim_mmap_threshold) {
+        memset(mem, 0, num * size);
+    }
+    return mem;
+}
+
+SHIM_EXPORT void *realloc(void *mem, size_t size)
+{
+    size_t usable;
+
+    if (shim_in_pool) {
+        return __libc_realloc(mem, size);
+    }
+    if (mem == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(mem);
+        return NULL;
+    }
+
+    if (_shim_kind_of(mem, &usable) == SHIM_LIBC) {
+        return __libc_realloc(mem, size);
+    }
+
+    // shrinking (or growing into the slack) stays put, otherwise move
+    if (size <= usable) {
+        return mem;
+    }
+    void *moved = malloc(size);
+    if (moved != NULL) {
+        memcpy(moved, mem, usable);
+        free(mem);
+    }
+    return moved;
+}
+
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (shim_in_pool) {
+        *memptr = __libc_memalign(alignment, size);
+        return (*memptr != NULL) ? 0 : ENOMEM;
+    }
+
+    void *mem = _shim_alloc(size, (alignment > SHIM_ALIGNMENT) ? alignment : SHIM_ALIGNMENT);
+    if (mem == NULL) {
+        return ENOMEM;
+    }
+    *memptr = mem;
+    return 0;
+}
+
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (shim_in_pool) {
+        return __libc_memalign(alignment, size);
+    }
+    return _shim_alloc(size, (alignment > SHIM_ALIGNMENT) ? alignment : SHIM_ALIGNMENT);
+}
+
+SHIM_EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *mem)
+{
+    size_t usable = 0;
+
+    if (mem == NULL) {
+        return 0;
+    }
+    if (shim_in_pool) {
+        return (shim_libc_usable_size != NULL) ? shim_libc_usable_size(mem) : 0;
+    }
+    _shim_kind_of(mem, &usable);
+    return usable;
+}
@@ -0,0 +1,188 @@
+/*
+ * Container benchmark for the std::pmr adapter (see mem_pool.hpp).
+ *
+ * Every request builds the same per-request data structures, a vector of
+ * numbers, a vector of strings and an unordered_map of strings, then lets
+ * them go. Their memory comes from
+ *
+ *   default     the default resource (new and delete)
+ *   monotonic   a std::pmr::monotonic_buffer_resource, released per request
+ *   first_fit   a FIRST_FIT pool, the containers freeing their memory
+ *   best_fit    a BEST_FIT pool, likewise
+ *   teardown    a FIRST_FIT pool per request, destroyed with the containers
+ *               still in it, so no destructor runs and nothing is freed one
+ *               by one
+ *
+ * usage: mem_pool_pmr_bench [num_requests] [items_per_request]
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mem_pool.hpp"
+
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned   BENCH_DEFAULT_NUM_REQUESTS      = 200;
+static const unsigned   BENCH_DEFAULT_ITEMS             = 10000;
+static const size_t     BENCH_POOL_SIZE                 = 64 * 1024 * 1024;
+
+static const char       BENCH_TEXT[]                    = "a name that is well past the small-string buffer of any library";
+static const unsigned   BENCH_MIN_NAME                  = 24; // longer than the small-string buffer
+static const unsigned   BENCH_NAME_SPREAD               = 32;
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+struct request_t {
+    std::pmr::vector<unsigned> numbers;
+    std::pmr::vector<std::pmr::string> names;
+    std::pmr::unordered_map<unsigned, std::pmr::string> index;
+
+    explicit request_t(std::pmr::memory_resource *resource)
+            : numbers(resource), names(resource), index(resource) {}
+};
+
+struct result_t {
+    double requests_per_sec;
+    unsigned long long checksum;
+};
+
+
+
+/*******************/
+/*                 */
+/* Static routines */
+/*                 */
+/*******************/
+static unsigned long long _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long _fill(request_t &request, unsigned items)
+{
+    unsigned long long checksum = 0;
+
+    for (unsigned i = 0; i < items; ++i) {
+        request.numbers.push_back(i * 2654435761u);
+        request.names.emplace_back(BENCH_TEXT, BENCH_MIN_NAME + i % BENCH_NAME_SPREAD);
+        request.index.emplace(i, request.names.back());
+    }
+
+    // look some up, so the work isn't thrown away
+    for (unsigned i = 0; i < items; i += 7) {
+        checksum += request.index.find(i)->second.size() + request.numbers[i];
+    }
+    return checksum;
+}
+
+template <typename Run>
+static result_t _time(unsigned num_requests, Run run)
+{
+    result_t result = {0, 0};
+
+    unsigned long long start = _now_ns();
+    for (unsigned r = 0; r < num_requests; ++r) {
+        result.checksum += run();
+    }
+    result.requests_per_sec = num_requests / ((_now_ns() - start) / 1e9);
+
+    return result;
+}
+
+static void _print_result(const char *resource, const result_t &result, double baseline)
+{
+    printf("%-10s %14.0f %10.2fx %20llu\n",
+           resource, result.requests_per_sec, result.requests_per_sec / baseline, result.checksum);
+}
+
+
+
+/********/
+/*      */
+/* main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    unsigned num_requests = (argc > 1) ? (unsigned) strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_NUM_REQUESTS;
+    unsigned items = (argc > 2) ? (unsigned) strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_ITEMS;
+
+    if (num_requests == 0 || items == 0) {
+        fprintf(stderr, "usage: %s [num_requests] [items_per_request]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%u requests of %u items\n\n", num_requests, items);
+    printf("%-10s %14s %11s %20s\n", "resource", "requests/sec", "vs default", "checksum");
+
+    result_t baseline = _time(num_requests, [&] {
+        request_t request(std::pmr::new_delete_resource());
+        return _fill(request, items);
+    });
+    _print_result("default", baseline, baseline.requests_per_sec);
+
+    std::pmr::monotonic_buffer_resource monotonic;
+    result_t result = _time(num_requests, [&] {
+        unsigned long long checksum;
+        {
+            request_t request(&monotonic);
+            checksum = _fill(request, items);
+        }
+        monotonic.release();
+        return checksum;
+    });
+    _print_result("monotonic", result, baseline.requests_per_sec);
+
+    {
+        mem::pool<mem::first_fit> pool(BENCH_POOL_SIZE);
+        mem::resource resource(pool);
+        result = _time(num_requests, [&] {
+            request_t request(&resource);
+            return _fill(request, items);
+        });
+    }
+    _print_result("first_fit", result, baseline.requests_per_sec);
+
+    {
+        mem::pool<mem::best_fit> pool(BENCH_POOL_SIZE);
+        mem::resource resource(pool);
+        result = _time(num_requests, [&] {
+            request_t request(&resource);
+            return _fill(request, items);
+        });
+    }
+    _print_result("best_fit", result, baseline.requests_per_sec);
+
+    result = _time(num_requests, [&] {
+        // the request lives in its pool, and goes with it
+        mem::pool<mem::first_fit> pool(BENCH_POOL_SIZE);
+        mem::resource resource(pool);
+        request_t *request = new (resource.allocate(sizeof(request_t), alignof(request_t))) request_t(&resource);
+        unsigned long long checksum = _fill(*request, items);
+        pool.destroy();
+        return checksum;
+    });
+    _print_result("teardown", result, baseline.requests_per_sec);
+
+    mem_free();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/*
+ * Replays an allocation trace (see mem_trace.h) against the memory pool.
+ *
+ * The trace is memory-mapped and decoded up front, so the timed loop only
+ * calls into the pool. The policy recorded with each pool can be kept or
+ * overridden, so the same workload can be compared across policies.
+ *
+ * usage: mem_pool_replay trace [recorded | first_fit | best_fit | bitmap]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem_pool.h"
+#include "mem_trace.h"
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef struct _replay_op {
+    trace_op op;
+    unsigned pool_id;
+    size_t size;             // pool size for TRACE_POOL_OPEN
+    unsigned long handle_id; // handle id + 1 for TRACE_ALLOC, 0 if it failed
+    alloc_policy policy;
+} replay_op_t, *replay_op_pt;
+
+typedef struct _replay_pool {
+    pool_pt pool;
+    alloc_pt *handles;       // indexed by handle id
+    unsigned long num_handles;
+} replay_pool_t, *replay_pool_pt;
+
+
+
+/*******************/
+/*                 */
+/* Static routines */
+/*                 */
+/*******************/
+static unsigned long long _now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static replay_op_pt _decode(const unsigned char *pos, const unsigned char *end,
+                            unsigned long *num_ops, unsigned *num_pools)
+{
+    unsigned long capacity = 1024;
+    replay_op_pt ops = malloc(capacity * sizeof(replay_op_t));
+    unsigned long long value;
+
+    if (ops == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    *num_ops = 0;
+    *num_pools = 0;
+
+    while (pos < end) {
+        replay_op_t op;
+        memset(&op, 0, sizeof(op));
+
+        op.op = (trace_op) *pos++;
+        if (!trace_get_varint(&pos, end, &value)) {
+            break;
+        }
+        op.pool_id = (unsigned) value;
+
+        switch (op.op) {
+            case TRACE_POOL_OPEN:
+                if (!trace_get_varint(&pos, end, &value) || pos == end) {
+                    goto truncated;
+                }
+                op.size = (size_t) value;
+                op.policy = (alloc_policy) *pos++;
+                if (op.pool_id >= *num_pools) {
+                    *num_pools = op.pool_id + 1;
+                }
+                break;
+            case TRACE_POOL_CLOSE:
+                break;
+            case TRACE_ALLOC:
+                if (!trace_get_varint(&pos, end, &value)) {
+                    goto truncated;
+                }
+                op.size = (size_t) value;
+                if (!trace_get_varint(&pos, end, &value)) {
+                    goto truncated;
+                }
+                op.handle_id = (unsigned long) value;
+                break;
+            case TRACE_DEL_ALLOC:
+                if (!trace_get_varint(&pos, end, &value)) {
+                    goto truncated;
+                }
+                op.handle_id = (unsigned long) value;
+                break;
+            default:
+                fprintf(stderr, "bad record type %d\n", op.op);
+                free(ops);
+                return NULL;
+        }
+
+        if (*num_ops == capacity) {
+            replay_op_pt grown = realloc(ops, 2 * capacity * sizeof(replay_op_t));
+            if (grown == NULL) {
+                perror("realloc");
+                free(ops);
+                return NULL;
+            }
+            ops = grown;
+            capacity *= 2;
+        }
+        ops[(*num_ops)++] = op;
+    }
+    return ops;
+
+truncated:
+    fprintf(stderr, "trace truncated after %lu records\n", *num_ops);
+    return ops;
+}
+
+static int _set_handle(replay_pool_pt rp, unsigned long handle_id, alloc_pt alloc)
+{
+    // handle ids are reused once freed, so the table stays about as large as the most allocations live at once
+    if (handle_id >= rp->num_handles) {
+        unsigned long num_handles = rp->num_handles ? rp->num_handles : 64;
+        while (num_handles <= handle_id) {
+            num_handles *= 2;
+        }
+        alloc_pt *handles = realloc(rp->handles, num_handles * sizeof(alloc_pt));
+        if (handles == NULL) {
+            perror("realloc");
+            return 0;
+        }
+        rp->handles = handles;
+        memset(rp->handles + rp->num_handles, 0,
+               (num_handles - rp->num_handles) * sizeof(alloc_pt));
+        rp->num_handles = num_handles;
+    }
+    rp->handles[handle_id] = alloc;
+    return 1;
+}
+
+
+
+/********/
+/*      */
+/* main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [recorded|first_fit|best_fit|bitmap]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *mode = (argc > 2) ? argv[2] : "recorded";
+    int override = strcmp(mode, "recorded") != 0;
+    alloc_policy policy = (strcmp(mode, "best_fit") == 0) ? BEST_FIT :
+                          (strcmp(mode, "bitmap") == 0) ? BITMAP : FIRST_FIT;
+    if (override && strcmp(mode, "first_fit") != 0 && strcmp(mode, "best_fit") != 0
+        && strcmp(mode, "bitmap") != 0) {
+        fprintf(stderr, "unknown policy: %s\n", mode);
+        return EXIT_FAILURE;
+    }
+
+    // map the trace
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (st.st_size < TRACE_MAGIC_SIZE + 1) {
+        fprintf(stderr, "%s: not a trace\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    const unsigned char *trace = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    if (memcmp(trace, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0 || trace[TRACE_MAGIC_SIZE] != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d trace\n", argv[1], TRACE_VERSION);
+        return EXIT_FAILURE;
+    }
+
+    // decode everything up front, so the replay runs at full speed
+    unsigned long num_ops = 0;
+    unsigned num_pools = 0;
+    replay_op_pt ops = _decode(trace + TRACE_MAGIC_SIZE + 1, trace + st.st_size, &num_ops, &num_pools);
+    munmap((void *) trace, (size_t) st.st_size);
+    if (ops == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    replay_pool_pt pools = calloc(num_pools ? num_pools : 1, sizeof(replay_pool_t));
+    if (pools == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    unsigned long allocs = 0, dels = 0, failed = 0, mismatched = 0;
+
+    mem_init();
+
+    unsigned long long start = _now_ns();
+    for (unsigned long u = 0; u < num_ops; ++u) {
+        replay_op_pt op = &ops[u];
+        replay_pool_pt rp = (op->pool_id < num_pools) ? &pools[op->pool_id] : NULL;
+
+        if (rp == NULL || (op->op != TRACE_POOL_OPEN && rp->pool == NULL)) {
+            ++mismatched;
+            continue;
+        }
+
+        switch (op->op) {
+            case TRACE_POOL_OPEN:
+                rp->pool = mem_pool_open(op->size, override ? policy : op->policy);
+                if (rp->pool == NULL) {
+                    fprintf(stderr, "could not open pool %u of %lu bytes\n",
+                            op->pool_id, (unsigned long) op->size);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case TRACE_POOL_CLOSE:
+                // free whatever a different policy left behind, then close
+                for (unsigned long h = 0; h < rp->num_handles; ++h) {
+                    if (rp->handles[h] != NULL) {
+                        mem_del_alloc(rp->pool, rp->handles[h]);
+                    }
+                }
+                mem_pool_close(rp->pool);
+                free(rp->handles);
+                memset(rp, 0, sizeof(replay_pool_t));
+                break;
+            case TRACE_ALLOC: {
+                alloc_pt alloc = mem_new_alloc(rp->pool, op->size);
+                ++allocs;
+                if (alloc == NULL) {
+                    ++failed;
+                }
+                if (op->handle_id != 0) {
+                    if (!_set_handle(rp, op->handle_id - 1, alloc)) {
+                        return EXIT_FAILURE;
+                    }
+                }
+                else if (alloc != NULL) {
+                    // failed when recorded, but fits now: give it back
+                    mem_del_alloc(rp->pool, alloc);
+                }
+                break;
+            }
+            case TRACE_DEL_ALLOC:
+                if (op->handle_id < rp->num_handles && rp->handles[op->handle_id] != NULL) {
+                    mem_del_alloc(rp->pool, rp->handles[op->handle_id]);
+                    rp->handles[op->handle_id] = NULL;
+                    ++dels;
+                }
+                else {
+                    ++mismatched;
+                }
+                break;
+        }
+    }
+    double seconds = (_now_ns() - start) / 1e9;
+
+    // pools the trace did not close
+    for (unsigned p = 0; p < num_pools; ++p) {
+        if (pools[p].pool != NULL) {
+            pool_stats_t stats;
+            mem_pool_stats(pools[p].pool, &stats);
+            printf("pool %u left open: %llu nodes, %llu gaps, fragmentation %.4f\n",
+                   p, (unsigned long long) stats.used_nodes, (unsigned long long) stats.num_gaps,
+                   stats.fragmentation);
+            for (unsigned long h = 0; h < pools[p].num_handles; ++h) {
+                if (pools[p].handles[h] != NULL) {
+                    mem_del_alloc(pools[p].pool, pools[p].handles[h]);
+                }
+            }
+            mem_pool_close(pools[p].pool);
+            free(pools[p].handles);
+        }
+    }
+    mem_free();
+
+    printf("policy:      %s\n", mode);
+    printf("records:     %lu\n", num_ops);
+    printf("allocs:      %lu (%lu failed)\n", allocs, failed);
+    printf("deallocs:    %lu\n", dels);
+    printf("mismatched:  %lu\n", mismatched);
+    printf("time:        %.3f s (%.0f ops/sec)\n", seconds, num_ops / seconds);
+
+    free(pools);
+    free(ops);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/*
+ * Binary format of the allocation traces written by mem_trace_open().
+ *
+ * A trace is the magic "MPTR", a version byte, then records of
+ *
+ *     op (1 byte)  pool id (varint)  operands
+ *
+ *     TRACE_POOL_OPEN   size (varint)  policy (1 byte)
+ *     TRACE_POOL_CLOSE  -
+ *     TRACE_ALLOC       size (varint)  handle id + 1 (varint, 0 if failed)
+ *     TRACE_DEL_ALLOC   handle id (varint)
+ *
+ * Varints are unsigned LEB128. Pool ids count every pool the process
+ * opened, traced or not, so they are never reused. Pools that are open
+ * when the trace starts get a TRACE_POOL_OPEN record then, with the
+ * allocations already in them left out. A handle id is given to an
+ * allocation by its pool, the most recently freed one first, so ids stay
+ * below the most allocations the pool had at once, whatever the policy.
+ * Allocations made before the trace started have none, and their
+ * deallocations are not recorded.
+ */
+
+#ifndef DENVER_OS_PA_C_MEM_TRACE_H
+#define DENVER_OS_PA_C_MEM_TRACE_H
+
+#include <stddef.h>
+
+#define TRACE_MAGIC         "MPTR"
+#define TRACE_MAGIC_SIZE    4
+#define TRACE_VERSION       1
+#define TRACE_MAX_VARINT    10 // bytes in the varint of a 64-bit value
+
+typedef enum _trace_op {
+    TRACE_POOL_OPEN = 1,
+    TRACE_POOL_CLOSE,
+    TRACE_ALLOC,
+    TRACE_DEL_ALLOC
+} trace_op;
+
+/* writes the varint of value to buf, returns the number of bytes */
+static inline size_t trace_put_varint(unsigned char *buf, unsigned long long value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char) value;
+    return n;
+}
+
+/* reads a varint at *pos, returns 0 and leaves *pos if it runs past end */
+static inline int trace_get_varint(const unsigned char **pos, const unsigned char *end,
+                                   unsigned long long *value) {
+    const unsigned char *p = *pos;
+    unsigned long long result = 0;
+    unsigned shift = 0;
+    while (p < end && shift < 7 * TRACE_MAX_VARINT) {
+        result |= (unsigned long long) (*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *value = result;
+            *pos = p;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+#endif //DENVER_OS_PA_C_MEM_TRACE_H
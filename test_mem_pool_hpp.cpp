@@ -0,0 +1,278 @@
+/*
+ * Tests of the C++ wrapper (see mem_pool.hpp): size classes and rounding,
+ * handles, objects, pools of each policy and the std::pmr adapter.
+ */
+
+#include <cstdint>
+#include <memory_resource>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+
+extern "C" {
+#include "cmocka.h" // a C library, whose header doesn't say so
+}
+#include "mem_pool.hpp"
+
+
+/*****            constants            *****/
+
+static const std::size_t POOL_SIZE = 1 << 20;
+
+
+/*****            helpers             *****/
+
+using classes = mem::size_classes<32, 64, 128>;
+
+static std::size_t num_allocs(pool_pt pool) {
+    return pool->num_allocs;
+}
+
+static bool aligned(const void *mem, std::size_t alignment) {
+    return reinterpret_cast<std::uintptr_t>(mem) % alignment == 0;
+}
+
+/* counts its live instances, and throws from the constructor when asked */
+struct counted {
+    static int live;
+    int value;
+
+    explicit counted(int v, bool fail = false) : value(v) {
+        if (fail) {
+            throw std::runtime_error("counted");
+        }
+        ++live;
+    }
+    ~counted() { --live; }
+};
+
+int counted::live = 0;
+
+struct alignas(64) line {
+    char bytes[64];
+};
+
+
+/*****              tests              *****/
+
+static void test_size_classes(void **state) {
+    (void) state; /* unused */
+
+    static_assert(classes::ascending(), "");
+    static_assert(!mem::size_classes<64, 32>::ascending(), "");
+    static_assert(classes::round(100) == 128, "");
+
+    // a request goes to the first class that holds it, larger ones stay as they are
+    assert_int_equal(classes::round(0), 32);
+    assert_int_equal(classes::round(32), 32);
+    assert_int_equal(classes::round(33), 64);
+    assert_int_equal(classes::round(128), 128);
+    assert_int_equal(classes::round(129), 129);
+    assert_int_equal(mem::size_classes<>::round(7), 7);
+
+    // then up to a multiple of the alignment
+    using classed = mem::pool<mem::best_fit, 16, classes>;
+    using plain = mem::pool<mem::first_fit, 8>;
+    assert_int_equal(classed::round(100), 128);
+    assert_int_equal(classed::round(129), 144);
+    assert_int_equal(plain::round(1), 8);
+    assert_int_equal(plain::round(static_cast<std::size_t>(-1)), static_cast<std::size_t>(-1));
+}
+
+static void test_handle(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Allocations are rounded to their class and aligned.
+     * 2. Move construction and assignment hand the allocation over, and
+     *    assigning over a handle frees what it held.
+     * 3. A handle frees its allocation when it goes, or gives it up on release.
+     */
+
+    {
+        mem::pool<mem::best_fit, 16, classes> pool(POOL_SIZE);
+
+        // 1. rounded and aligned
+        mem::handle a = pool.allocate(100);
+        assert_true(static_cast<bool>(a));
+        assert_int_equal(a.size(), 128);
+        assert_true(aligned(a.get(), 16));
+        assert_ptr_equal(a.pool(), pool.get());
+
+        // 2. moves
+        mem::handle b(std::move(a));
+        assert_false(static_cast<bool>(a));
+        assert_true(static_cast<bool>(b));
+
+        mem::handle c = pool.allocate(20);
+        assert_int_equal(num_allocs(pool.get()), 2);
+        c = std::move(b);
+        assert_int_equal(num_allocs(pool.get()), 1);
+        assert_false(static_cast<bool>(b));
+        assert_int_equal(c.size(), 128);
+
+        // 3. release and reset
+        alloc_pt raw = c.release();
+        assert_false(static_cast<bool>(c));
+        assert_int_equal(pool.raw_free(raw), ALLOC_OK);
+        {
+            mem::handle d = pool.allocate(1);
+            assert_int_equal(num_allocs(pool.get()), 1);
+        }
+        assert_int_equal(num_allocs(pool.get()), 0);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_object(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. make<T> constructs in pool memory, and the object destroys and frees it.
+     * 2. Objects move like handles.
+     * 3. If the constructor throws, the memory goes back to the pool.
+     */
+
+    {
+        mem::pool<mem::first_fit, 16> pool(POOL_SIZE);
+
+        // 1. make
+        {
+            mem::object<counted> p = pool.make<counted>(7);
+            assert_true(static_cast<bool>(p));
+            assert_int_equal(p->value, 7);
+            assert_int_equal((*p).value, 7);
+            assert_int_equal(counted::live, 1);
+            assert_int_equal(num_allocs(pool.get()), 1);
+        }
+        assert_int_equal(counted::live, 0);
+        assert_int_equal(num_allocs(pool.get()), 0);
+
+        // 2. moves
+        mem::object<counted> p = pool.make<counted>(1);
+        mem::object<counted> q = pool.make<counted>(2);
+        q = std::move(p);
+        assert_false(static_cast<bool>(p));
+        assert_int_equal(q->value, 1);
+        assert_int_equal(counted::live, 1);
+        assert_int_equal(num_allocs(pool.get()), 1);
+        mem::object<counted> r(std::move(q));
+        assert_int_equal(r->value, 1);
+        r.reset();
+        assert_int_equal(counted::live, 0);
+        assert_int_equal(num_allocs(pool.get()), 0);
+
+        // 3. a throwing constructor
+        bool thrown = false;
+        try {
+            pool.make<counted>(3, true);
+        }
+        catch (const std::runtime_error &) {
+            thrown = true;
+        }
+        assert_true(thrown);
+        assert_int_equal(counted::live, 0);
+        assert_int_equal(num_allocs(pool.get()), 0);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_bitmap(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. A bitmap pool aligns to its chunks, and rounds requests to them.
+     * 2. It holds objects aligned that far.
+     * 3. Pools move, and destroy() closes one with allocations still in it.
+     */
+
+    {
+        mem::pool<mem::bitmap> pool(64 * 100);
+        static_assert(decltype(pool)::alignment == 64, "");
+
+        // 1. chunks
+        mem::handle a = pool.allocate(10);
+        mem::handle b = pool.allocate(65);
+        assert_int_equal(a.size(), 64);
+        assert_int_equal(b.size(), 128);
+        assert_true(aligned(a.get(), 64));
+        assert_true(aligned(b.get(), 64));
+
+        // 2. over-aligned objects
+        mem::object<line> l = pool.make<line>();
+        assert_true(aligned(l.get(), 64));
+
+        // 3. move and destroy
+        mem::pool<mem::bitmap> moved(std::move(pool));
+        assert_null(pool.get());
+        assert_non_null(moved.get());
+        a.release();
+        b.release();
+        l.reset();
+        moved.destroy();
+        assert_null(moved.get());
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_resource(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * 1. Alignment above the pool's base alignment comes out of the slack.
+     * 2. Through a pool, requests are rounded as the pool's own.
+     * 3. Standard containers allocate and free through it.
+     */
+
+    {
+        mem::pool<mem::first_fit, 8> pool(POOL_SIZE);
+
+        // 1. over-aligned
+        mem::resource bare(pool.get(), 8);
+        for (std::size_t alignment = 16; alignment <= 512; alignment *= 2) {
+            void *mem = bare.allocate(100, alignment);
+            assert_true(aligned(mem, alignment));
+            assert_int_equal(num_allocs(pool.get()), 1);
+            bare.deallocate(mem, 100, alignment);
+            assert_int_equal(num_allocs(pool.get()), 0);
+        }
+
+        // 2. rounded
+        mem::resource rounded(pool);
+        void *mem = rounded.allocate(3, 64);
+        assert_true(aligned(mem, 64));
+        assert_true(rounded.is_equal(bare));
+        rounded.deallocate(mem, 3, 64);
+
+        // 3. containers
+        {
+            std::pmr::vector<int> numbers(&rounded);
+            for (int i = 0; i < 1000; ++i) {
+                numbers.push_back(i);
+            }
+            assert_int_equal(numbers[999], 999);
+            assert_true(num_allocs(pool.get()) > 0);
+        }
+        assert_int_equal(num_allocs(pool.get()), 0);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*****              main               *****/
+
+int main() {
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test(test_size_classes),
+            cmocka_unit_test(test_handle),
+            cmocka_unit_test(test_object),
+            cmocka_unit_test(test_pool_bitmap),
+            cmocka_unit_test(test_resource),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
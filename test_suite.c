@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -11,6 +12,7 @@
 
 #include "cmocka.h"
 #include "mem_pool.h"
+#include "mem_trace.h"
 #include "test_suite.h"
 
 
@@ -31,7 +33,7 @@ static const unsigned POOL_SIZE           = 1000000;
 
 static void print_pool(pool_pt pool) {
     pool_segment_pt segs = NULL;
-    unsigned size = 0;
+    mem_count_t size = 0;
 
     assert_non_null(pool);
 
@@ -54,7 +56,7 @@ static void print_pool(pool_pt pool) {
 
 static void check_pool(pool_pt pool, const pool_segment_pt exp) {
     pool_segment_pt segs = NULL;
-    unsigned size = 0;
+    mem_count_t size = 0;
 
     assert_non_null(pool);
 
@@ -84,7 +86,7 @@ static void check_metadata(pool_pt pool,
                     unsigned num_allocs,
                     unsigned num_gaps) {
     pool_segment_pt segs = NULL;
-    unsigned size = 0;
+    mem_count_t size = 0;
 
     assert_non_null(pool);
 
@@ -100,8 +102,8 @@ static void check_metadata(pool_pt pool,
     printf("%10s = %lu(%lu),\n%10s = %lu(%lu),\n%10s = %u(%u),\n%10s = %u(%u)\n",
            (char *) "total_size", pool->total_size, total_size,
            (char *) "alloc_size", pool->alloc_size, alloc_size,
-           (char *) "num_allocs", pool->num_allocs, num_allocs,
-           (char *) "num_gaps",   pool->num_gaps,   num_gaps);
+           (char *) "num_allocs", (unsigned) pool->num_allocs, num_allocs,
+           (char *) "num_gaps",   (unsigned) pool->num_gaps,   num_gaps);
 #endif
 
     if (segs) free(segs);
@@ -235,6 +237,42 @@ static void test_pool_nonempty(void **state) {
 }
 
 
+static void test_pool_store_many(void **state) {
+    (void) state; /* unused */
+
+    const unsigned NUM_POOLS = 10000;
+    pool_pt *pools = (pool_pt *) calloc(NUM_POOLS, sizeof(pool_pt));
+    assert_non_null(pools);
+
+    /*
+     * 1. Open many small pools, so the pool store grows a few times.
+     * 2. Close every other one, and open them again into the freed slots.
+     * 3. Leave them all open, one with an allocation, and free the store.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned u = 0; u < NUM_POOLS; ++u) {
+        pools[u] = mem_pool_open(1000, (u % 2) ? FIRST_FIT : BEST_FIT);
+        assert_non_null(pools[u]);
+    }
+
+    for (unsigned u = 0; u < NUM_POOLS; u += 2) {
+        assert_int_equal(mem_pool_close(pools[u]), ALLOC_OK);
+    }
+    for (unsigned u = 0; u < NUM_POOLS; u += 2) {
+        pools[u] = mem_pool_open(1000, FIRST_FIT);
+        assert_non_null(pools[u]);
+    }
+
+    assert_non_null(mem_new_alloc(pools[NUM_POOLS / 2], 100));
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_CALLED_AGAIN);
+
+    free(pools);
+}
+
 /*******************************************/
 /***       2. USER-FACING METADATA       ***/
 /*******************************************/
@@ -462,6 +500,1331 @@ static void test_pool_bf_metadata(void **state) {
 }
 
 
+static void test_pool_ff_oom(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Pool starts out as a single gap.
+     * 2. Request more than the pool holds.
+     * 3. Fill the pool, leaving two gaps of 100.
+     * 4. Request 200, which is more than the largest gap.
+     * 5. Clean up.
+     */
+
+    assert_null(mem_new_alloc(pool, POOL_SIZE + 1));
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, POOL_SIZE - 300);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE - 200, 2, 2);
+
+
+    assert_null(mem_new_alloc(pool, 200));
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE - 200, 2, 2);
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+static void test_pool_ff_histogram(void **state) {
+    pool_pt pool = *state;
+    pool_histogram_t hist;
+
+    /*
+     * 1. Allocate 3 x 100 and 1 x 1000.
+     * 2. Request more than the pool holds.
+     * 3. Deallocate one 100.
+     * 4. Check the size classes.
+     * 5. Clean up.
+     */
+
+    if (mem_pool_histogram(pool, &hist) != ALLOC_OK) {
+        INFO("Size-class histogram compiled out, skipping\n");
+        return;
+    }
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    alloc_pt alloc3 = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc3);
+    assert_null(mem_new_alloc(pool, POOL_SIZE + 1));
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    assert_int_equal(mem_pool_histogram(pool, &hist), ALLOC_OK);
+    assert_int_equal(hist.classes[6].live_allocs, 2);     // 100 in [64, 128)
+    assert_int_equal(hist.classes[6].total_allocs, 3);
+    assert_int_equal(hist.classes[6].live_size, 200);
+    assert_int_equal(hist.classes[6].total_size, 300);
+    assert_int_equal(hist.classes[9].live_allocs, 1);     // 1000 in [512, 1024)
+    assert_int_equal(hist.classes[9].live_size, 1000);
+    assert_int_equal(hist.classes[19].failed_allocs, 1);  // 1000001 in [2^19, 2^20)
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+
+    assert_int_equal(mem_pool_histogram(pool, &hist), ALLOC_OK);
+    assert_int_equal(hist.classes[6].live_allocs, 0);
+    assert_int_equal(hist.classes[6].live_size, 0);
+    assert_int_equal(hist.classes[9].live_allocs, 0);
+}
+
+static void test_pool_del_bad_handle(void **state) {
+    (void) state; /* unused */
+
+    const alloc_policy policies[3] = {FIRST_FIT, BEST_FIT, BITMAP};
+    pool_histogram_t hist;
+
+    /*
+     * For each policy:
+     * 1. Allocate 100.
+     * 2. Deallocate NULL, a record outside the pool, and the allocation's memory.
+     *    All fail and leave the pool (and its histogram) as it was.
+     * 3. Deallocate the 100, then again. The second one fails.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (int p=0; p<3; ++p) {
+        pool_pt pool = mem_pool_open(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+
+
+        // 1. allocate 100
+        alloc_pt alloc0 = mem_new_alloc(pool, 100);
+        assert_non_null(alloc0);
+
+
+        // 2. deallocate bad handles
+        alloc_t garbage = {(size_t) -1, (char *) &garbage};
+        assert_int_equal(mem_del_alloc(pool, NULL), ALLOC_FAIL);
+        assert_int_equal(mem_del_alloc(pool, &garbage), ALLOC_FAIL);
+        assert_int_equal(mem_del_alloc(pool, (alloc_pt) alloc0->mem), ALLOC_FAIL);
+        check_metadata(pool, policies[p], POOL_SIZE, 100, 1, 1);
+        if (mem_pool_histogram(pool, &hist) == ALLOC_OK) {
+            assert_int_equal(hist.classes[6].live_allocs, 1);     // 100 in [64, 128)
+            assert_int_equal(hist.classes[6].live_size, 100);
+        }
+
+
+        // 3. deallocate the 100, twice
+        assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+        check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+        if (mem_pool_histogram(pool, &hist) == ALLOC_OK) {
+            assert_int_equal(hist.classes[6].live_allocs, 0);
+            assert_int_equal(hist.classes[6].live_size, 0);
+        }
+
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_ff_profile(void **state) {
+    pool_pt pool = *state;
+    pool_profile_t prof;
+
+    /*
+     * 1. Allocate 3 x 100.
+     * 2. Deallocate the first two, then allocate 200 (one scan past the head).
+     * 3. Check the counters.
+     * 4. Clean up.
+     */
+
+    if (mem_pool_profile(pool, &prof) != ALLOC_OK) {
+        INFO("Hot-path profiling compiled out, skipping\n");
+        return;
+    }
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc2);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    alloc_pt alloc3 = mem_new_alloc(pool, 200);
+    assert_non_null(alloc3);
+
+    assert_int_equal(mem_pool_profile(pool, &prof), ALLOC_OK);
+    assert_int_equal(prof.allocs, 4);
+    assert_int_equal(prof.dels, 2);
+    assert_true(prof.nodes_visited > 0);
+    assert_true(prof.max_nodes_visited <= prof.nodes_visited);
+    assert_int_equal(prof.gaps_visited, 0);
+    assert_true(prof.lookup_visited >= 2);
+    assert_true(prof.rotations > 0);
+    assert_true(prof.alloc_ticks_p50 <= prof.alloc_ticks_p99);
+    assert_true(prof.alloc_ticks_p99 <= prof.alloc_ticks_p999);
+    assert_true(prof.del_ticks_p50 <= prof.del_ticks_p999);
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+}
+
+static int count_segment(const pool_segment_t *segment, void *ctx) {
+    pool_segment_pt acc = ctx;
+
+    // size adds up, allocated counts the segments
+    acc->size += segment->size;
+    ++(acc->allocated);
+
+    return 0;
+}
+
+static int stop_at_gap(const pool_segment_t *segment, void *ctx) {
+    ++(*(unsigned *) ctx);
+
+    return !segment->allocated;
+}
+
+static void test_pool_ff_iterate(void **state) {
+    pool_pt pool = *state;
+    pool_segment_t acc = {0, 0};
+    pool_cursor_t cursor = {0, NULL};
+    unsigned visited = 0;
+
+    /*
+     * 1. Allocate 10 x 100 and deallocate 1, (3, 4), 8.
+     * 2. A full walk covers the pool in 8 segments.
+     * 3. The walk stops when the callback says so.
+     * 4. A cursor walk, 3 segments at a time, survives allocations in between.
+     * 5. Clean up.
+     */
+
+    const unsigned NUM_ALLOCS = 10;
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK); allocs[4]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+
+
+    // 2. full walk
+    assert_int_equal(mem_pool_iterate(pool, count_segment, &acc), ALLOC_OK);
+    assert_int_equal(acc.size, POOL_SIZE);
+    assert_int_equal(acc.allocated, 10);
+
+
+    // 3. stop at the first gap
+    assert_int_equal(mem_pool_iterate(pool, stop_at_gap, &visited), ALLOC_OK);
+    assert_int_equal(visited, 2);
+
+
+    // 4. cursor walk: the first step covers 0, 1, 2
+    acc.size = 0; acc.allocated = 0;
+    assert_int_equal(mem_pool_iterate_from(pool, &cursor, 3, count_segment, &acc), ALLOC_OK);
+    assert_int_equal(acc.allocated, 3);
+    assert_int_equal(cursor.offset, 300);
+
+    // the next segment, the (3, 4) gap, is split up before the walk resumes
+    allocs[3] = mem_new_alloc(pool, 150);
+    assert_non_null(allocs[3]);
+    while (cursor.offset < pool->total_size) {
+        assert_int_equal(mem_pool_iterate_from(pool, &cursor, 3, count_segment, &acc), ALLOC_OK);
+    }
+    assert_int_equal(acc.size, POOL_SIZE);
+    assert_int_equal(acc.allocated, 11);
+
+    // a walk past the end reports nothing
+    assert_int_equal(mem_pool_iterate_from(pool, &cursor, 3, count_segment, &acc), ALLOC_OK);
+    assert_int_equal(acc.allocated, 11);
+
+
+    // 5. clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+}
+
+static void test_pool_ff_deferred(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Allocate 6 x 100 and defer coalescing of up to 4 blocks.
+     * 2. Deallocate 1 and 3. They stay put, no gaps are merged.
+     * 3. Allocate 100. It reuses 3 as is.
+     * 4. Deallocate 3, 0, 2, then 4 goes over the limit and all of them merge.
+     * 5. Deallocate 5, and allocate the whole pool: the miss merges it first.
+     * 6. Deallocate it, turn deferring off, and the pool is one gap.
+     */
+
+    const unsigned NUM_ALLOCS = 6;
+    alloc_pt allocs[NUM_ALLOCS];
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_pool_defer_coalescing(pool, 4), ALLOC_OK);
+
+
+    // 2. deallocate 1 and 3
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_FAIL);
+
+    pool_segment_t exp0[7] =
+            {
+                    {100, 1},
+                    {100, 0},
+                    {100, 1},
+                    {100, 0},
+                    {100, 1},
+                    {100, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 400, 4, 1);
+
+
+    // 3. allocate 100
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_ptr_equal(alloc, allocs[3]);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 500, 5, 1);
+
+
+    // 4. deallocate 3, 0, 2, 4
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 200, 2, 1);
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK);
+
+    pool_segment_t exp1[3] =
+            {
+                    {500, 0},
+                    {100, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100, 1, 2);
+
+
+    // 5. deallocate 5, allocate POOL_SIZE
+    assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK);
+    alloc = mem_new_alloc(pool, POOL_SIZE);
+    assert_non_null(alloc);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE, 1, 0);
+
+
+    // 6. clean up
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_defer_coalescing(pool, 0), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+static void test_pool_ff_lowest_address(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Allocate 3 x 100.
+     * 2. Deallocate 0 and 2. The gap after 2 merges with the rest of the pool.
+     * 3. Allocate 50. It splits the first gap, its remainder takes a new node.
+     * 4. Allocate 50. The remainder comes first by address, though its node does not.
+     */
+
+    alloc_pt allocs[3];
+
+    for (int i=0; i<3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+
+
+    // 2. deallocate 0 and 2
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+
+
+    // 3. allocate 50
+    alloc_pt alloc0 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc0);
+    assert_ptr_equal(alloc0->mem, pool->mem);
+
+
+    // 4. allocate 50
+    alloc_pt alloc1 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc1);
+    assert_ptr_equal(alloc1->mem, pool->mem + 50);
+
+    pool_segment_t exp[4] =
+            {
+                    {50, 1},
+                    {50, 1},
+                    {100, 1},
+                    {POOL_SIZE - 200, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 200, 3, 1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+}
+
+static void test_pool_ff_zero_size(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Allocate 0 sixteen times, then 100. All the zeros are at the start.
+     * 2. Deallocate the even zeros. The eight gaps share one address.
+     * 3. Allocate 0 twice, and 50. They go to the first gaps that fit.
+     * 4. Clean up. The pool is one gap again, and can be allocated whole.
+     */
+
+    const unsigned NUM_ZEROS = 16;
+    alloc_pt zeros[NUM_ZEROS];
+
+    for (int i=0; i<NUM_ZEROS; ++i) {
+        zeros[i] = mem_new_alloc(pool, 0);
+        assert_non_null(zeros[i]);
+        assert_ptr_equal(zeros[i]->mem, pool->mem);
+    }
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+
+
+    // 2. deallocate the even zeros
+    for (int i=0; i<NUM_ZEROS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, zeros[i]), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100, NUM_ZEROS / 2 + 1, NUM_ZEROS / 2 + 1);
+
+
+    // 3. allocate 0 twice, and 50
+    alloc_pt alloc1 = mem_new_alloc(pool, 0);
+    assert_non_null(alloc1);
+    assert_ptr_equal(alloc1->mem, pool->mem);
+    alloc_pt alloc3 = mem_new_alloc(pool, 0);
+    assert_non_null(alloc3);
+    assert_ptr_not_equal(alloc3, alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc2);
+    assert_ptr_equal(alloc2->mem, pool->mem + 100);
+
+
+    // 4. clean up
+    for (int i=1; i<NUM_ZEROS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, zeros[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    alloc0 = mem_new_alloc(pool, POOL_SIZE);
+    assert_non_null(alloc0);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+}
+
+static void test_pool_ff_tune(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * 1. Round to 16 bytes, and keep remainders under 64 with the allocation.
+     * 2. Allocate 10, 100, 200, 16. They are rounded up.
+     * 3. Deallocate the 112, and allocate 60. The 48 left over goes with it.
+     * 4. Deallocate the 208, and allocate 130. The 64 left over is a gap.
+     * 5. Clean up.
+     */
+
+    assert_int_equal(mem_pool_tune(pool, 24, 0), ALLOC_FAIL);
+    assert_int_equal(mem_pool_tune(pool, 16, 64), ALLOC_OK);
+
+
+    // 2. allocate 10, 100, 200, 16
+    alloc_pt alloc0 = mem_new_alloc(pool, 10);
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    alloc_pt alloc2 = mem_new_alloc(pool, 200);
+    alloc_pt alloc3 = mem_new_alloc(pool, 16);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_non_null(alloc3);
+    assert_int_equal(alloc0->size, 16);
+    assert_int_equal(alloc1->size, 112);
+    assert_int_equal(alloc2->size, 208);
+    assert_int_equal(alloc3->size, 16);
+
+
+    // 3. deallocate the 112, allocate 60
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    alloc1 = mem_new_alloc(pool, 60);
+    assert_non_null(alloc1);
+    assert_int_equal(alloc1->size, 112);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 352, 4, 1);
+
+
+    // 4. deallocate the 208, allocate 130
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    alloc2 = mem_new_alloc(pool, 130);
+    assert_non_null(alloc2);
+    assert_int_equal(alloc2->size, 144);
+
+    pool_segment_t exp[6] =
+            {
+                    {16, 1},
+                    {112, 1},
+                    {144, 1},
+                    {64, 0},
+                    {16, 1},
+                    {POOL_SIZE - 352, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 288, 4, 2);
+
+
+    // 5. clean up
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+}
+
+static void test_pool_bf_stats(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
+
+    /*
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100.
+     * 3. Deallocate 1, (3, 4), 8
+     * 4. Check the gap extremes and the fragmentation.
+     * 5. Clean up.
+     */
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE);
+    assert_int_equal(stats.smallest_gap, POOL_SIZE);
+    assert_int_equal(stats.free_size, POOL_SIZE);
+    assert_true(stats.fragmentation == 0.0);
+    assert_int_equal(stats.used_nodes, 1);
+    assert_int_equal(stats.num_gaps, 1);
+    assert_true(stats.total_nodes >= stats.used_nodes);
+    assert_true(stats.metadata_size > 0);
+
+
+    const unsigned NUM_ALLOCS = 10;
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK); allocs[4]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE - 1000);
+    assert_int_equal(stats.smallest_gap, 100);
+    assert_int_equal(stats.free_size, POOL_SIZE - 600);
+    assert_true(stats.fragmentation > 0.0 && stats.fragmentation < 0.001);
+    assert_int_equal(stats.used_nodes, 10);
+    assert_int_equal(stats.num_gaps, 4);
+
+
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE);
+    assert_int_equal(stats.num_gaps, 1);
+    assert_true(stats.fragmentation == 0.0);
+}
+
+
+static void test_pool_ff_shrink(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t start, peak, end;
+
+    /*
+     * 1. Allocate 1000 x 100.
+     * 2. Deallocate the odd ones, leaving 500 gaps.
+     * 3. Deallocate the even ones. The metadata goes back to where it started.
+     */
+
+    const unsigned NUM_ALLOCS = 1000;
+
+    assert_int_equal(mem_pool_stats(pool, &start), ALLOC_OK);
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+
+
+    // 2. deallocate the odd ones
+    for (int i=1; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_pool_stats(pool, &peak), ALLOC_OK);
+    assert_int_equal(peak.num_gaps, NUM_ALLOCS / 2);
+    assert_true(peak.total_nodes > start.total_nodes);
+
+
+    // 3. deallocate the even ones
+    for (int i=0; i<NUM_ALLOCS; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+
+    assert_int_equal(mem_pool_stats(pool, &end), ALLOC_OK);
+    assert_int_equal(end.num_gaps, 1);
+    assert_int_equal(end.total_nodes, start.total_nodes);
+    assert_int_equal(end.metadata_size, start.metadata_size);
+}
+
+static void test_pool_sparse(void **state) {
+    (void) state; /* unused */
+
+    const size_t GiB = (size_t) 1 << 30;
+
+    /*
+     * For each policy:
+     * 1. Open an 8 GiB pool. It is mapped, and only what is touched is committed.
+     * 2. Allocate 5 GiB, then 2 GiB, which ends past the first 4 GiB.
+     * 3. Check the sizes, the addresses, and the last gap.
+     * 4. Deallocate both and close.
+     */
+
+    if (sizeof(size_t) < 8) {
+        return;
+    }
+
+    const alloc_policy policies[] = {FIRST_FIT, BEST_FIT, BITMAP};
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (int p=0; p<3; ++p) {
+        pool_stats_t stats;
+
+        pool_pt pool = mem_pool_open(8 * GiB, policies[p]);
+        assert_non_null(pool);
+
+
+        // 2. allocate 5 GiB, then 2 GiB
+        alloc_pt alloc0 = mem_new_alloc(pool, 5 * GiB);
+        assert_non_null(alloc0);
+        alloc_pt alloc1 = mem_new_alloc(pool, 2 * GiB);
+        assert_non_null(alloc1);
+
+
+        // 3. check them, and what is left
+        assert_true(alloc0->size == 5 * GiB);
+        assert_true(alloc1->size == 2 * GiB);
+        assert_true(alloc1->mem >= pool->mem + 5 * GiB);
+        assert_true(pool->alloc_size == 7 * GiB);
+        assert_int_equal(pool->num_allocs, 2);
+        assert_int_equal(pool->num_gaps, 1);
+
+        assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+        assert_true(stats.largest_gap > GiB / 2 && stats.largest_gap <= GiB);
+        assert_null(mem_new_alloc(pool, 2 * GiB));
+
+
+        // 4. deallocate both and close
+        assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static size_t put_trace_record(unsigned char *buf, trace_op op, unsigned long long pool_id,
+                               int num_operands, unsigned long long operand0,
+                               unsigned long long operand1) {
+    // a record as mem_trace.h lays it out
+    size_t n = 0;
+    buf[n++] = (unsigned char) op;
+    n += trace_put_varint(buf + n, pool_id);
+    if (num_operands > 0) {
+        n += trace_put_varint(buf + n, operand0);
+    }
+    if (num_operands > 1) {
+        if (op == TRACE_POOL_OPEN) {
+            buf[n++] = (unsigned char) operand1;
+        }
+        else {
+            n += trace_put_varint(buf + n, operand1);
+        }
+    }
+    return n;
+}
+
+static void test_pool_trace(void **state) {
+    (void) state; /* unused */
+
+    const char *TRACE_PATH = "test_trace.bin";
+
+    /*
+     * 1. Open pool 0 and allocate 200 before the trace starts.
+     * 2. Record: open pool 1, allocate 100 and 300, deallocate the 100,
+     *    allocate 50 (it gets the id of the 100), request too much,
+     *    deallocate the 300 and the 50. In pool 0, deallocate the 200
+     *    (it has no id), allocate 10 and deallocate it. Close both.
+     * 3. Check the records against the format in mem_trace.h. Pool 0
+     *    is opened when the trace starts, and pool 1's id is the next one.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool0);
+    alloc_pt early = mem_new_alloc(pool0, 200);
+    assert_non_null(early);
+
+    if (mem_trace_open(TRACE_PATH) != ALLOC_OK) {
+        INFO("Trace recording compiled out, skipping\n");
+        assert_int_equal(mem_del_alloc(pool0, early), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+        assert_int_equal(mem_free(), ALLOC_OK);
+        return;
+    }
+    assert_int_equal(mem_trace_open(TRACE_PATH), ALLOC_CALLED_AGAIN);
+
+
+    // 2. record
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc1);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    alloc_pt alloc2 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc2);
+    assert_null(mem_new_alloc(pool, POOL_SIZE));
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool0, early), ALLOC_OK);
+    alloc_pt alloc3 = mem_new_alloc(pool0, 10);
+    assert_non_null(alloc3);
+    assert_int_equal(mem_del_alloc(pool0, alloc3), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_trace_close(), ALLOC_OK);
+
+
+    // 3. check the records
+    unsigned char trace[256];
+
+    FILE *file = fopen(TRACE_PATH, "rb");
+    assert_non_null(file);
+    size_t size = fread(trace, 1, sizeof(trace), file);
+    fclose(file);
+    remove(TRACE_PATH);
+
+    // pool ids count every pool opened so far, so take pool 0's from the trace
+    const unsigned char *pos = trace + TRACE_MAGIC_SIZE + 2;
+    unsigned long long id0 = 0;
+    assert_true(size > TRACE_MAGIC_SIZE + 2);
+    assert_int_equal(trace_get_varint(&pos, trace + size, &id0), 1);
+    unsigned long long id1 = id0 + 1;
+
+    unsigned char exp[256] = {'M', 'P', 'T', 'R', TRACE_VERSION};
+    size_t n = TRACE_MAGIC_SIZE + 1;
+    n += put_trace_record(exp + n, TRACE_POOL_OPEN,  id0, 2, POOL_SIZE, FIRST_FIT);
+    n += put_trace_record(exp + n, TRACE_POOL_OPEN,  id1, 2, POOL_SIZE, BEST_FIT);
+    n += put_trace_record(exp + n, TRACE_ALLOC,      id1, 2, 100, 1);
+    n += put_trace_record(exp + n, TRACE_ALLOC,      id1, 2, 300, 2);
+    n += put_trace_record(exp + n, TRACE_DEL_ALLOC,  id1, 1, 0, 0);
+    n += put_trace_record(exp + n, TRACE_ALLOC,      id1, 2, 50, 1);
+    n += put_trace_record(exp + n, TRACE_ALLOC,      id1, 2, POOL_SIZE, 0);
+    n += put_trace_record(exp + n, TRACE_DEL_ALLOC,  id1, 1, 1, 0);
+    n += put_trace_record(exp + n, TRACE_DEL_ALLOC,  id1, 1, 0, 0);
+    n += put_trace_record(exp + n, TRACE_ALLOC,      id0, 2, 10, 1);
+    n += put_trace_record(exp + n, TRACE_DEL_ALLOC,  id0, 1, 0, 0);
+    n += put_trace_record(exp + n, TRACE_POOL_CLOSE, id1, 0, 0, 0);
+    n += put_trace_record(exp + n, TRACE_POOL_CLOSE, id0, 0, 0, 0);
+
+    assert_int_equal(size, n);
+    assert_memory_equal(exp, trace, n);
+}
+
+
+static void test_pool_sample(void **state) {
+    (void) state; /* unused */
+
+    const char *SAMPLE_PATH = "test_sample.txt";
+
+    /*
+     * 1. Sample every allocation (an interval of 1 byte): open pool,
+     *    allocate 100, 300 and 500, deallocate the 300, dump.
+     * 2. Check the totals and the stacks of the two live samples.
+     * 3. Destroy the pool with them in it, dump: no samples left.
+     */
+
+    if (mem_sample_open(1) != ALLOC_OK) {
+        INFO("Allocation sampling compiled out, skipping\n");
+        return;
+    }
+    assert_int_equal(mem_sample_open(1), ALLOC_CALLED_AGAIN);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_non_null(mem_new_alloc(pool, 100));
+    alloc_pt alloc1 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc1);
+    assert_non_null(mem_new_alloc(pool, 500));
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_sample_dump(SAMPLE_PATH), ALLOC_OK);
+
+    unsigned long count, size, alloc_count, alloc_size, interval;
+    char line[4096];
+    unsigned num_stacks = 0;
+
+    FILE *file = fopen(SAMPLE_PATH, "r");
+    assert_non_null(file);
+    assert_int_equal(fscanf(file, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+                            &count, &size, &alloc_count, &alloc_size, &interval), 5);
+    assert_int_equal(count, 2);
+    assert_int_equal(size, 600);
+    assert_int_equal(alloc_count, 2);
+    assert_int_equal(alloc_size, 600);
+    assert_int_equal(interval, 1);
+    while (fgets(line, sizeof(line), file) != NULL && line[0] != '\n') {
+        assert_int_equal(sscanf(line, "1: %lu [1: %lu] @ 0x", &size, &alloc_size), 2);
+        assert_true(size == 100 || size == 500);
+        assert_non_null(strstr(line, "@ 0x"));
+        ++num_stacks;
+    }
+    fclose(file);
+    assert_int_equal(num_stacks, 2);
+
+    assert_int_equal(mem_pool_destroy(pool), ALLOC_OK);
+    assert_int_equal(mem_sample_dump(SAMPLE_PATH), ALLOC_OK);
+    file = fopen(SAMPLE_PATH, "r");
+    assert_non_null(file);
+    assert_int_equal(fscanf(file, "heap profile: %lu: %lu", &count, &size), 2);
+    assert_int_equal(count, 0);
+    assert_int_equal(size, 0);
+    fclose(file);
+    remove(SAMPLE_PATH);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_sample_close(), ALLOC_OK);
+    assert_int_equal(mem_sample_close(), ALLOC_CALLED_AGAIN);
+    assert_int_equal(mem_sample_dump(SAMPLE_PATH), ALLOC_FAIL);
+}
+
+
+static void test_pool_bitmap(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+    pool_stats_t stats;
+
+    /*
+     * 1. Open a BITMAP pool a little short of a whole number of chunks.
+     * 2. Allocate 64, 100, 1000, 10. Each takes the chunks for its size, the records are apart.
+     * 3. Deallocate the 100 and the 10. Double, interior and copied-handle deallocations fail.
+     * 4. Allocate 200 (too big for the hole) and 100 (first fit into the hole).
+     * 5. Allocate past the first block of records, which grow with the live allocations and shrink back.
+     * 6. Clean up.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE - 10, BITMAP);
+    assert_non_null(pool);
+    check_metadata(pool, BITMAP, POOL_SIZE, 0, 0, 1);
+
+
+    // 2. allocate 64, 100, 1000, 10
+    alloc_pt alloc0 = mem_new_alloc(pool, 64);
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    alloc_pt alloc2 = mem_new_alloc(pool, 1000);
+    alloc_pt alloc3 = mem_new_alloc(pool, 10);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_non_null(alloc3);
+    assert_int_equal(alloc2->size, 1000);
+    assert_int_equal((size_t) alloc2->mem % 64, 0);
+    assert_ptr_equal(alloc1->mem, alloc0->mem + 64);
+    memset(alloc2->mem, 0xff, alloc2->size);
+
+    pool_segment_t exp0[5] =
+            {
+                    {64, 1},
+                    {128, 1},
+                    {1024, 1},
+                    {64, 1},
+                    {POOL_SIZE - 1280, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, BITMAP, POOL_SIZE, 1174, 4, 1);
+
+
+    // 3. deallocate the 100 and the 10
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, (alloc_pt) (alloc2->mem + 48)), ALLOC_FAIL);
+    alloc_t copy = *alloc2;
+    assert_int_equal(mem_del_alloc(pool, &copy), ALLOC_FAIL);
+
+    pool_segment_t exp1[4] =
+            {
+                    {64, 1},
+                    {128, 0},
+                    {1024, 1},
+                    {POOL_SIZE - 1216, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, BITMAP, POOL_SIZE, 1064, 2, 2);
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE - 1216);
+    assert_int_equal(stats.smallest_gap, 128);
+    assert_int_equal(stats.free_size, POOL_SIZE - 1088);
+    assert_int_equal(stats.num_gaps, 2);
+
+
+    // 4. allocate 200 and 100
+    alloc_pt alloc4 = mem_new_alloc(pool, 200);
+    alloc_pt alloc5 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc4);
+    assert_non_null(alloc5);
+    assert_ptr_equal(alloc5, alloc1);
+
+    pool_segment_t exp2[5] =
+            {
+                    {64, 1},
+                    {128, 1},
+                    {1024, 1},
+                    {256, 1},
+                    {POOL_SIZE - 1472, 0}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, BITMAP, POOL_SIZE, 1364, 4, 1);
+
+
+    // 5. allocate 200 chunks more
+    pool_stats_t start;
+    alloc_pt more[200];
+    assert_int_equal(mem_pool_stats(pool, &start), ALLOC_OK);
+    for (unsigned u = 0; u < 200; ++u) {
+        more[u] = mem_new_alloc(pool, 64);
+        assert_non_null(more[u]);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_true(stats.metadata_size > start.metadata_size);
+    assert_int_equal(stats.free_size, start.free_size - 200 * 64);
+    for (unsigned u = 0; u < 200; ++u) {
+        assert_int_equal(mem_del_alloc(pool, more[u]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.metadata_size, start.metadata_size);
+    assert_int_equal(stats.free_size, start.free_size);
+
+
+    // 6. clean up
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc4), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc5), ALLOC_OK);
+    check_metadata(pool, BITMAP, POOL_SIZE, 0, 0, 1);
+
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+
+static void test_pool_bitmap_scan(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+    pool_stats_t stats;
+
+    /*
+     * 1. Open a BITMAP pool of 773 chunks, 12 bitmap words and a part.
+     * 2. Allocate 1 chunk and 575 chunks, so the first 9 words are full, then free the 1 chunk.
+     * 3. Allocate 2 chunks (past the full words, whichever way they are scanned) and 1 (the first).
+     * 4. Clean up.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+    pool_pt pool = mem_pool_open(773 * 64, BITMAP);
+    assert_non_null(pool);
+
+
+    // 2. allocate 1 and 575 chunks, free the 1
+    alloc_pt alloc0 = mem_new_alloc(pool, 64);
+    alloc_pt alloc1 = mem_new_alloc(pool, 575 * 64);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_ptr_equal(alloc1->mem, pool->mem + 64);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, (773 - 576) * 64);
+    assert_int_equal(stats.smallest_gap, 64);
+
+
+    // 3. allocate 2 chunks and 1
+    alloc_pt alloc2 = mem_new_alloc(pool, 128);
+    alloc_pt alloc3 = mem_new_alloc(pool, 64);
+    assert_non_null(alloc2);
+    assert_non_null(alloc3);
+    assert_ptr_equal(alloc2->mem, pool->mem + 576 * 64);
+    assert_ptr_equal(alloc3->mem, pool->mem);
+
+    pool_segment_t exp[4] =
+            {
+                    {64, 1},
+                    {575 * 64, 1},
+                    {128, 1},
+                    {(773 - 578) * 64, 0}
+            };
+    check_pool(pool, exp);
+
+
+    // 4. clean up
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+
+#define STACK_ENGINE_DEPTH 8
+
+/* a registered engine: allocations are stacked up and come off the top */
+typedef struct _stack_engine {
+    alloc_t records[STACK_ENGINE_DEPTH];
+    unsigned depth;
+    size_t top;
+} stack_engine_t;
+
+static unsigned stack_engine_closed = 0;
+
+static alloc_status stack_engine_open(pool_pt pool, void **state) {
+    (void) pool;
+    *state = calloc(1, sizeof(stack_engine_t));
+    return (*state != NULL) ? ALLOC_OK : ALLOC_FAIL;
+}
+
+static void stack_engine_close(pool_pt pool, void *state) {
+    (void) pool;
+    free(state);
+    ++stack_engine_closed;
+}
+
+static alloc_pt stack_engine_alloc(pool_pt pool, void *state, size_t size) {
+    stack_engine_t *stack = (stack_engine_t *) state;
+
+    if (stack->depth == STACK_ENGINE_DEPTH || size > pool->total_size - stack->top) {
+        return NULL;
+    }
+    alloc_pt alloc = &stack->records[stack->depth++];
+    alloc->mem = pool->mem + stack->top;
+    alloc->size = size;
+    stack->top += size;
+
+    ++pool->num_allocs;
+    pool->alloc_size += size;
+    pool->num_gaps = (stack->top < pool->total_size) ? 1 : 0;
+    return alloc;
+}
+
+static alloc_status stack_engine_del_alloc(pool_pt pool, void *state, alloc_pt alloc, alloc_pt freed) {
+    stack_engine_t *stack = (stack_engine_t *) state;
+
+    if (stack->depth == 0 || alloc != &stack->records[stack->depth - 1]) {
+        return ALLOC_FAIL;
+    }
+    *freed = *alloc;
+    --stack->depth;
+    stack->top -= alloc->size;
+
+    --pool->num_allocs;
+    pool->alloc_size -= alloc->size;
+    pool->num_gaps = 1;
+    return ALLOC_OK;
+}
+
+static void stack_engine_next_segment(pool_pt pool, void *state,
+                                      pool_cursor_pt cursor, pool_segment_pt segment) {
+    stack_engine_t *stack = (stack_engine_t *) state;
+    char *start = pool->mem + cursor->offset;
+
+    segment->allocated = 0;
+    segment->size = pool->total_size - cursor->offset;
+    for (unsigned d = 0; d < stack->depth; ++d) {
+        if (stack->records[d].mem + stack->records[d].size > start) {
+            segment->allocated = 1;
+            segment->size = stack->records[d].mem + stack->records[d].size - start;
+            break;
+        }
+    }
+}
+
+static alloc_status stack_engine_stats(pool_pt pool, void *state, pool_stats_pt stats) {
+    (void) state;
+    memset(stats, 0, sizeof(pool_stats_t));
+    stats->free_size = pool->total_size - pool->alloc_size;
+    stats->largest_gap = stats->free_size;
+    stats->smallest_gap = stats->free_size;
+    stats->num_gaps = pool->num_gaps;
+    return ALLOC_OK;
+}
+
+static void test_pool_engine(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+    alloc_policy policy;
+    pool_stats_t stats;
+    pool_engine_t engine = {"stack", 0, stack_engine_open, stack_engine_close,
+                            NULL, stack_engine_del_alloc,
+                            stack_engine_next_segment, stack_engine_stats};
+
+    /*
+     * 1. Register an engine. One without alloc is refused, and its policy
+     *    opens nothing until it is registered.
+     * 2. Open a pool with it. Allocate 100, 200, 300.
+     * 3. Deallocate the 100 (fails, not on top), the 300 and the 200.
+     * 4. Close with the 100 still allocated (fails), deallocate it, close.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+    assert_int_equal(mem_register_engine(&engine, &policy), ALLOC_FAIL);
+    assert_null(mem_pool_open(POOL_SIZE, (alloc_policy) (BITMAP + 1)));
+
+    engine.alloc = stack_engine_alloc;
+    assert_int_equal(mem_register_engine(&engine, &policy), ALLOC_OK);
+    assert_int_equal(policy, BITMAP + 1);
+
+
+    // 2. open a pool, allocate 100, 200, 300
+    pool_pt pool = mem_pool_open(POOL_SIZE, policy);
+    assert_non_null(pool);
+    check_metadata(pool, policy, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_tune(pool, 16, 0), ALLOC_FAIL);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    alloc_pt alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    assert_ptr_equal(alloc2->mem, pool->mem + 300);
+
+    pool_segment_t exp0[4] =
+            {
+                    {100, 1},
+                    {200, 1},
+                    {300, 1},
+                    {POOL_SIZE - 600, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, policy, POOL_SIZE, 600, 3, 1);
+
+
+    // 3. deallocate the 100, the 300 and the 200
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    pool_segment_t exp1[2] =
+            {
+                    {100, 1},
+                    {POOL_SIZE - 100, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, policy, POOL_SIZE, 100, 1, 1);
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.free_size, POOL_SIZE - 100);
+
+
+    // 4. close, deallocate the 100, close
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    stack_engine_closed = 0;
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+    assert_int_equal(stack_engine_closed, 1);
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+static void test_pool_destroy(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+
+    /*
+     * 1. Open a FIRST_FIT and a BITMAP pool. Allocate 100 times in each.
+     * 2. Closing fails with the allocations in, destroying doesn't.
+     * 3. The pool store takes new pools as before.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+    pool_pt pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    pool_pt pool1 = mem_pool_open(POOL_SIZE, BITMAP);
+    assert_non_null(pool0);
+    assert_non_null(pool1);
+
+    for (unsigned u = 0; u < 100; ++u) {
+        assert_non_null(mem_new_alloc(pool0, 100 + u));
+        assert_non_null(mem_new_alloc(pool1, 100 + u));
+    }
+
+
+    // 2. close, then destroy
+    assert_int_equal(mem_pool_close(pool0), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_destroy(pool0), ALLOC_OK);
+    assert_int_equal(mem_pool_destroy(pool1), ALLOC_OK);
+    assert_int_equal(mem_pool_destroy(NULL), ALLOC_NOT_FREED);
+
+
+    // 3. open and close another pool
+    pool_pt pool2 = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool2);
+    check_metadata(pool2, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    status = mem_pool_close(pool2);
+    assert_int_equal(status, ALLOC_OK);
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+static void test_group_routing(void **state) {
+    (void) state; /* unused */
+
+    pool_group_class_t classes[5] =
+            {
+                    {64, 64 * 1024, BITMAP},
+                    {128, 64 * 1024, BITMAP},
+                    {256, 64 * 1024, BITMAP},
+                    {4096, POOL_SIZE, BEST_FIT},
+                    {(size_t) -1, POOL_SIZE, FIRST_FIT}
+            };
+    const unsigned NUM_SMALL = 64 * 1024 / 64;
+
+    /*
+     * 1. Open a group of three slab-like, a BEST_FIT and a FIRST_FIT member.
+     * 2. Requests go to the member for their size. Bad handles are refused.
+     * 3. When the smallest member is full, its requests spill over to the next.
+     * 4. A group with allocations doesn't close, and none of its members do.
+     * 5. Clean up, leaving a second group open for mem_free.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_group_pt group = mem_group_open(classes, 5);
+    assert_non_null(group);
+    assert_int_equal(group->num_pools, 5);
+
+
+    // 2. routing
+    size_t sizes[7] = {0, 64, 65, 256, 257, 4096, 5000};
+    unsigned members[7] = {0, 0, 1, 2, 3, 3, 4};
+    alloc_pt allocs[7];
+
+    for (int i=0; i<7; ++i) {
+        allocs[i] = mem_group_alloc(group, sizes[i]);
+        assert_non_null(allocs[i]);
+        assert_int_equal(allocs[i]->size, sizes[i]);
+        assert_int_equal(group->pools[members[i]]->num_allocs, (i == 1 || i == 5) ? 2 : 1);
+    }
+    for (int i=0; i<7; ++i) {
+        assert_int_equal(mem_group_del_alloc(group, allocs[i]), ALLOC_OK);
+    }
+    alloc_t garbage = {(size_t) -1, (char *) &garbage};
+    assert_int_equal(mem_group_del_alloc(group, NULL), ALLOC_FAIL);
+    assert_int_equal(mem_group_del_alloc(group, &garbage), ALLOC_FAIL);
+    assert_int_equal(mem_group_del_alloc(group, allocs[0]), ALLOC_FAIL);
+    assert_int_equal(mem_group_del_alloc(group, allocs[6]), ALLOC_FAIL);
+
+
+    // 3. spill over
+    alloc_pt *small = (alloc_pt *) calloc(NUM_SMALL + 1, sizeof(alloc_pt));
+    assert_non_null(small);
+
+    for (int i=0; i<=NUM_SMALL; ++i) {
+        small[i] = mem_group_alloc(group, 40);
+        assert_non_null(small[i]);
+    }
+    assert_int_equal(group->pools[0]->num_allocs, NUM_SMALL);
+    assert_int_equal(group->pools[1]->num_allocs, 1);
+
+
+    // 4. can't close
+    assert_int_equal(mem_group_close(group), ALLOC_NOT_FREED);
+    alloc_pt large = mem_group_alloc(group, 5000);
+    assert_non_null(large);
+    assert_int_equal(mem_group_del_alloc(group, large), ALLOC_OK);
+
+
+    // 5. clean up
+    for (int i=0; i<=NUM_SMALL; ++i) {
+        assert_int_equal(mem_group_del_alloc(group, small[i]), ALLOC_OK);
+    }
+    free(small);
+
+    assert_int_equal(group->pools[0]->num_allocs, 0);
+    assert_int_equal(group->pools[1]->num_allocs, 0);
+    assert_int_equal(mem_group_close(group), ALLOC_OK);
+    assert_non_null(mem_group_open(classes, 5));
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
 /*******************************************/
 /***       3. FIRST_FIT SCENARIOS        ***/
 /*******************************************/
@@ -2338,14 +3701,9 @@ void test_pool_stresstest(void **state) {
     alloc_pt allocations[num_pools][num_allocations];
 
     /*
-     * NOTE: This will work iff the address of the allocation
-     * in the pool is returned to the user instead of the
-     * address of the allocation record. Since allocation records
-     * are a part of the nodes, when the node heap is reallocated
-     * the node addresses shift with it, and so do the allocation
-     * record addresses. The allocation addresses on the pool
-     * remain the same, however, so they can be returned to the
-     * user and gotten from the user upon request for deletion.
+     * NOTE: Allocation records are a part of the nodes. The node
+     * heap grows by adding blocks instead of reallocating, so the
+     * records, and the handles to them, stay where they are.
      */
 
     /*
@@ -2417,9 +3775,29 @@ int run_test_suite() {
             cmocka_unit_test(test_pool_smoketest),
 
             cmocka_unit_test(test_pool_nonempty),
+            cmocka_unit_test(test_pool_store_many),
 
             cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_oom, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_histogram, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_del_bad_handle),
+            cmocka_unit_test_setup_teardown(test_pool_ff_profile, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_iterate, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_deferred, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_lowest_address, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_zero_size, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_tune, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_bf_stats, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_ff_shrink, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_sparse),
+            cmocka_unit_test(test_pool_trace),
+            cmocka_unit_test(test_pool_sample),
+            cmocka_unit_test(test_pool_bitmap),
+            cmocka_unit_test(test_pool_bitmap_scan),
+            cmocka_unit_test(test_pool_engine),
+            cmocka_unit_test(test_pool_destroy),
+            cmocka_unit_test(test_group_routing),
 
             cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
@@ -2443,14 +3821,12 @@ int run_test_suite() {
             cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
 
-            // do not uncomment until the project is changed to return the allocation address
-//            cmocka_unit_test(test_pool_stresstest),
+            cmocka_unit_test(test_pool_stresstest),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);
 }
 
 /* future editions */
-// TODO stress test: many pools, many allocations, many gaps (requires project refactoring, see NOTE in test body)
 // TODO test memory leaks: any way to do it w/o having to rewrite the source file?
 // TODO fix the final PASSED line of std::cerr output to the end of the file (?)